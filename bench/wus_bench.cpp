@@ -0,0 +1,375 @@
+// Compares the bucket sizing policies of weak_unordered_set on insertion,
+// successful lookups, and unsuccessful lookups, then how misses slow
+// down as the table fills, batch operations with single ones, iterators
+// with for_each_live, then how interning scales with threads, and
+// finally sequential and parallel rehashing and sweeping.
+//
+// Usage: intersections_bench [element-count]
+
+#include "util/concurrent_weak_unordered_set.h"
+#include "util/rcu_weak_unordered_set.h"
+#include "util/weak_unordered_set.h"
+#include "util/work_stealing_pool.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace intersections::util;
+
+namespace {
+
+// Mixes all the bits, so that every policy gets a fair hash.
+struct mixing_hash
+{
+    size_t operator()(size_t key) const
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return key;
+    }
+};
+
+using clock_type = std::chrono::steady_clock;
+
+double elapsed_ns(clock_type::time_point start, size_t operations)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock_type::now() - start).count();
+    return double(ns) / double(operations);
+}
+
+// Keeps the optimizer from discarding lookup results.
+volatile size_t sink;
+
+template <class SizePolicy>
+void run(const char* name, size_t count)
+{
+    using set_t = weak_unordered_set<size_t, mixing_hash,
+                                     std::equal_to<size_t>,
+                                     std::allocator<size_t>, SizePolicy>;
+
+    std::vector<std::shared_ptr<size_t>> holder;
+    holder.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        holder.push_back(std::make_shared<size_t>(2 * i));
+
+    set_t set;
+
+    auto start = clock_type::now();
+    for (const auto& each : holder)
+        set.insert(each);
+    double insert_ns = elapsed_ns(start, count);
+
+    size_t found = 0;
+    start = clock_type::now();
+    for (size_t i = 0; i < count; ++i)
+        found += set.member(2 * i);
+    double hit_ns = elapsed_ns(start, count);
+
+    start = clock_type::now();
+    for (size_t i = 0; i < count; ++i)
+        found += set.member(2 * i + 1);
+    double miss_ns = elapsed_ns(start, count);
+
+    sink = found;
+
+    std::cout << std::left << std::setw(14) << name << std::right
+              << std::fixed << std::setprecision(1)
+              << std::setw(10) << insert_ns
+              << std::setw(10) << hit_ns
+              << std::setw(10) << miss_ns
+              << std::setw(12) << set.bucket_count() << '\n';
+}
+
+// Looks up keys that are all absent, in tables of the same bucket count
+// filled to a quarter, half, and three quarters, just short of growing.
+// A miss scans the control bytes to the end of its cluster, so this is
+// where probing a group at a time pays off, and where clusters hurt.
+void run_misses(size_t count)
+{
+    using set_t = weak_unordered_set<size_t, mixing_hash>;
+
+    std::cout << '\n' << std::left << std::setw(14) << "misses"
+              << std::right;
+    for (const char* load : {"1/4", "1/2", "3/4"})
+        std::cout << std::setw(10) << load;
+    std::cout << '\n' << std::left << std::setw(14) << "" << std::right
+              << std::fixed << std::setprecision(1);
+
+    for (size_t quarters = 1; quarters <= 3; ++quarters) {
+        set_t set;
+        set.rehash(count);
+        size_t fill = set.bucket_count() * quarters / 4;
+
+        std::vector<std::shared_ptr<const size_t>> holder;
+        holder.reserve(fill);
+        for (size_t i = 0; i < fill; ++i) {
+            holder.push_back(std::make_shared<const size_t>(2 * i));
+            set.insert(holder.back());
+        }
+
+        size_t found = 0;
+        auto start = clock_type::now();
+        for (size_t i = 0; i < count; ++i)
+            found += set.member(2 * i + 1);
+        double miss_ns = elapsed_ns(start, count);
+
+        sink = found;
+        std::cout << std::setw(10) << miss_ns;
+    }
+
+    std::cout << '\n';
+}
+
+// Compares one-at-a-time insertion and lookup with the batch versions.
+void run_batch(size_t count)
+{
+    using set_t = weak_unordered_set<size_t, mixing_hash>;
+
+    std::vector<std::shared_ptr<const size_t>> holder;
+    std::vector<size_t> keys;
+    holder.reserve(count);
+    keys.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        holder.push_back(std::make_shared<const size_t>(2 * i));
+        keys.push_back(2 * i + i % 2);
+    }
+
+    set_t single, batch;
+
+    auto start = clock_type::now();
+    for (const auto& each : holder)
+        single.insert(each);
+    double single_insert_ns = elapsed_ns(start, count);
+
+    start = clock_type::now();
+    batch.insert(holder.begin(), holder.end());
+    double batch_insert_ns = elapsed_ns(start, count);
+
+    // Both collect their results, so that they do the same work.
+    std::vector<set_t::const_iterator> results;
+    results.reserve(count);
+    size_t found = 0;
+
+    start = clock_type::now();
+    for (size_t key : keys)
+        results.push_back(single.find(key));
+    for (const auto& each : results)
+        found += each != single.cend();
+    double single_find_ns = elapsed_ns(start, count);
+
+    results.clear();
+    start = clock_type::now();
+    batch.find_many(keys.begin(), keys.end(), std::back_inserter(results));
+    for (const auto& each : results)
+        found += each != batch.cend();
+    double batch_find_ns = elapsed_ns(start, count);
+
+    sink = found;
+
+    std::cout << '\n' << std::left << std::setw(14) << "" << std::right
+              << std::setw(10) << "insert"
+              << std::setw(10) << "find" << '\n'
+              << std::fixed << std::setprecision(1)
+              << std::left << std::setw(14) << "one at a time" << std::right
+              << std::setw(10) << single_insert_ns
+              << std::setw(10) << single_find_ns << '\n'
+              << std::left << std::setw(14) << "batch" << std::right
+              << std::setw(10) << batch_insert_ns
+              << std::setw(10) << batch_find_ns << '\n';
+}
+
+// Visits the live elements of a dense table and of a sparse one, where
+// a sixteenth of the buckets are taken, with iterators and with
+// for_each_live. Reports ns per live element.
+void run_traversal(size_t count)
+{
+    using set_t = weak_unordered_set<size_t, mixing_hash>;
+
+    std::cout << '\n' << std::left << std::setw(14) << "traversal"
+              << std::right
+              << std::setw(10) << "iterate"
+              << std::setw(10) << "for_each" << '\n';
+
+    for (size_t spread : {1, 16}) {
+        std::vector<std::shared_ptr<const size_t>> holder;
+        set_t set;
+        set.reserve(count);
+        for (size_t i = 0; i < count / spread; ++i) {
+            holder.push_back(std::make_shared<const size_t>(i));
+            set.insert(holder.back());
+        }
+
+        size_t sum = 0;
+        auto start = clock_type::now();
+        for (const auto& each : set)
+            sum += *each;
+        double iterate_ns = elapsed_ns(start, holder.size());
+
+        start = clock_type::now();
+        set.for_each_live([&](const std::shared_ptr<const size_t>& each) {
+            sum += *each;
+        });
+        double for_each_ns = elapsed_ns(start, holder.size());
+
+        sink = sum;
+
+        std::cout << std::left << std::setw(14)
+                  << (spread == 1 ? "dense" : "sparse") << std::right
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(10) << iterate_ns
+                  << std::setw(10) << for_each_ns << '\n';
+    }
+}
+
+// Runs `work(t)` on each of `threads` threads, returning the time in ns
+// per operation.
+template <class F>
+double time_threads(size_t threads, size_t operations, F work)
+{
+    std::vector<std::thread> workers;
+    auto start = clock_type::now();
+    for (size_t t = 0; t < threads; ++t)
+        workers.emplace_back(work, t);
+    for (auto& each : workers)
+        each.join();
+    return elapsed_ns(start, operations);
+}
+
+// Interns `count` keys, each a few times, from several threads, with a
+// single locked set, the sharded one, and the one with lock-free reads.
+void run_concurrent(size_t count)
+{
+    constexpr size_t repeats = 4;
+
+    std::cout << '\n' << std::left << std::setw(14) << "threads" << std::right
+              << std::setw(10) << "locked"
+              << std::setw(10) << "sharded"
+              << std::setw(10) << "rcu" << '\n';
+
+    for (size_t threads = 1;
+         threads <= std::max(4u, std::thread::hardware_concurrency());
+         threads *= 2) {
+        size_t per_thread = count / threads;
+        size_t operations = per_thread * threads * repeats;
+
+        // Each thread keeps its keys alive until it's done.
+        auto intern_all = [=](size_t t, auto intern) {
+            std::vector<std::shared_ptr<const size_t>> keep;
+            keep.reserve(per_thread);
+            for (size_t r = 0; r < repeats; ++r) {
+                for (size_t i = 0; i < per_thread; ++i) {
+                    auto key = intern(t * per_thread + i);
+                    if (r == 0) keep.push_back(std::move(key));
+                }
+            }
+        };
+
+        weak_unordered_set<size_t, mixing_hash> locked;
+        std::mutex mutex;
+        double locked_ns = time_threads(threads, operations, [&](size_t t) {
+            intern_all(t, [&](size_t key) {
+                std::lock_guard<std::mutex> lock(mutex);
+                return locked.try_emplace(key);
+            });
+        });
+
+        concurrent_weak_unordered_set<size_t, mixing_hash> sharded;
+        double sharded_ns = time_threads(threads, operations, [&](size_t t) {
+            intern_all(t, [&](size_t key) {
+                return sharded.try_emplace(key);
+            });
+        });
+
+        rcu_weak_unordered_set<size_t, mixing_hash> rcu;
+        double rcu_ns = time_threads(threads, operations, [&](size_t t) {
+            intern_all(t, [&](size_t key) {
+                return rcu.try_emplace(key);
+            });
+        });
+
+        std::cout << std::left << std::setw(14) << threads << std::right
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(10) << locked_ns
+                  << std::setw(10) << sharded_ns
+                  << std::setw(10) << rcu_ns << '\n';
+    }
+}
+
+// Times rehashing to twice the size, and removing the half of the
+// elements that have expired, with and without a pool.
+void run_parallel(size_t count)
+{
+    using set_t = weak_unordered_set<size_t, mixing_hash>;
+    work_stealing_pool pool;
+
+    std::cout << '\n' << std::left << std::setw(14) << "threads" << std::right
+              << std::setw(10) << "rehash"
+              << std::setw(10) << "sweep" << '\n';
+
+    std::vector<size_t> thread_counts{1};
+    if (pool.size() > 1) thread_counts.push_back(pool.size());
+
+    for (size_t threads : thread_counts) {
+        std::vector<std::shared_ptr<const size_t>> holder;
+        holder.reserve(count);
+        set_t set;
+        for (size_t i = 0; i < count; ++i) {
+            holder.push_back(std::make_shared<const size_t>(i));
+            set.insert(holder.back());
+        }
+
+        auto start = clock_type::now();
+        if (threads == 1)
+            set.rehash(2 * set.bucket_count());
+        else
+            set.rehash(2 * set.bucket_count(), pool);
+        double rehash_ns = elapsed_ns(start, count);
+
+        for (size_t i = 0; i < count; i += 2) holder[i] = nullptr;
+
+        start = clock_type::now();
+        if (threads == 1)
+            set.remove_expired();
+        else
+            set.remove_expired(pool);
+        double sweep_ns = elapsed_ns(start, count);
+
+        std::cout << std::left << std::setw(14) << threads << std::right
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(10) << rehash_ns
+                  << std::setw(10) << sweep_ns << '\n';
+    }
+}
+
+} // end anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+    std::cout << count << " elements, ns per operation\n"
+              << std::left << std::setw(14) << "policy" << std::right
+              << std::setw(10) << "insert"
+              << std::setw(10) << "hit"
+              << std::setw(10) << "miss"
+              << std::setw(12) << "buckets" << '\n';
+
+    run<power_of_two_sizing>("power of two", count);
+    run<fastrange_sizing>("fastrange", count);
+    run<prime_sizing>("prime", count);
+
+    run_misses(count);
+    run_batch(count);
+    run_traversal(count);
+    run_concurrent(count);
+    run_parallel(count);
+}
@@ -0,0 +1,74 @@
+#include "diagnostic.h"
+
+#include <cstring>
+#include <sstream>
+#include <string_view>
+
+namespace intersections {
+
+diagnostic::diagnostic(const char* format, std::vector<type> arguments)
+        : format_(format), arguments_(std::move(arguments))
+{ }
+
+void diagnostic::render(std::ostream& o) const
+{
+    auto next = arguments_.begin();
+
+    for (const char* p = format_; *p; ++p) {
+        if (p[0] == '{' && p[1] == '}' && next != arguments_.end()) {
+            o << *next++;
+            ++p;
+        } else {
+            o << *p;
+        }
+    }
+}
+
+std::string diagnostic::str() const
+{
+    std::ostringstream o;
+    render(o);
+    return o.str();
+}
+
+size_t diagnostic::hash() const
+{
+    size_t result = std::hash<std::string_view>{}(format_);
+
+    for (const auto& arg : arguments_) {
+        result = result * 31 + std::hash<const void*>{}(arg.impl().get());
+    }
+
+    return result;
+}
+
+bool operator==(const diagnostic& a, const diagnostic& b)
+{
+    return a.arguments_ == b.arguments_ &&
+           (a.format_ == b.format_ || std::strcmp(a.format_, b.format_) == 0);
+}
+
+bool diagnostic_sink::report(diagnostic d)
+{
+    if (!seen_.insert(d).second) return false;
+
+    diagnostics_.push_back(std::move(d));
+    return true;
+}
+
+void diagnostic_sink::rollback(size_t checkpoint)
+{
+    while (diagnostics_.size() > checkpoint) {
+        seen_.erase(diagnostics_.back());
+        diagnostics_.pop_back();
+    }
+}
+
+void diagnostic_sink::emit(std::ostream& o) const
+{
+    for (const auto& d : diagnostics_) {
+        o << d << '\n';
+    }
+}
+
+} // end namespace intersections
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "intersections.h"
+
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace intersections {
+
+/// A message about some types, which are formatted only when the message
+/// is rendered. Each `{}` in the format is replaced by the next argument.
+///
+/// The format is not copied, so it should be a string literal.
+class diagnostic {
+public:
+    diagnostic(const char* format, std::vector<type> arguments = {});
+
+    const char* format() const
+    {
+        return format_;
+    }
+
+    const std::vector<type>& arguments() const
+    {
+        return arguments_;
+    }
+
+    void render(std::ostream&) const;
+
+    std::string str() const;
+
+    /// Since types are interned, this compares arguments by identity.
+    size_t hash() const;
+
+private:
+    const char* format_;
+    std::vector<type> arguments_;
+
+    friend bool operator==(const diagnostic&, const diagnostic&);
+
+    friend std::ostream& operator<<(std::ostream& o, const diagnostic& d)
+    {
+        d.render(o);
+        return o;
+    }
+};
+
+bool operator==(const diagnostic&, const diagnostic&);
+
+inline bool operator!=(const diagnostic& a, const diagnostic& b)
+{
+    return !(a == b);
+}
+
+} // end namespace intersections
+
+namespace std {
+
+template <>
+struct hash<intersections::diagnostic>
+{
+    size_t operator()(const intersections::diagnostic& d) const
+    {
+        return d.hash();
+    }
+};
+
+} // end namespace std
+
+namespace intersections {
+
+/// Collects diagnostics, dropping duplicates. Speculative work, such as
+/// trying each overload in turn, can take a checkpoint and roll back to
+/// it to discard the diagnostics it reported.
+class diagnostic_sink {
+public:
+    /// Records a diagnostic, returning false if it's a duplicate.
+    bool report(diagnostic);
+
+    size_t checkpoint() const
+    {
+        return diagnostics_.size();
+    }
+
+    /// Discards the diagnostics reported since `checkpoint`.
+    void rollback(size_t checkpoint);
+
+    const std::vector<diagnostic>& diagnostics() const
+    {
+        return diagnostics_;
+    }
+
+    /// Renders each diagnostic on its own line.
+    void emit(std::ostream&) const;
+
+private:
+    std::vector<diagnostic> diagnostics_;
+    std::unordered_set<diagnostic> seen_;
+};
+
+} // end namespace intersections
@@ -1,8 +1,227 @@
 #include "intersections.h"
 #include "util/Separated.h"
+#include "util/concurrent_weak_unordered_set.h"
+
+#include <climits>
 
 namespace intersections {
 
+namespace {
+
+size_t combine_hash(size_t seed, size_t hash_code)
+{
+    return seed ^ (hash_code + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+}
+
+size_t hash_types(size_t seed, const std::vector<type>& types)
+{
+    for (const auto& ty : types) {
+        seed = combine_hash(seed, ty.hash());
+    }
+
+    return seed;
+}
+
+size_t hash_function(const std::vector<type>& arguments, const type& result)
+{
+    return combine_hash(hash_types(size_t(type_kind::Function), arguments),
+                        result.hash());
+}
+
+// The parts of a type, for looking it up without making a node.
+
+struct function_key {
+    const std::vector<type>& arguments;
+    const type& result;
+};
+
+struct intersection_key {
+    const std::vector<type>& members;
+};
+
+struct atomic_key {
+    type_kind kind;
+};
+
+struct type_impl_hash {
+    using is_transparent = void;
+
+    size_t operator()(const type_impl_base& ty) const
+    {
+        return ty.hash();
+    }
+
+    size_t operator()(const function_key& key) const
+    {
+        return hash_function(key.arguments, key.result);
+    }
+
+    size_t operator()(const intersection_key& key) const
+    {
+        return hash_types(size_t(type_kind::Intersection), key.members);
+    }
+
+    size_t operator()(const atomic_key& key) const
+    {
+        return size_t(key.kind);
+    }
+};
+
+struct type_impl_equal {
+    using is_transparent = void;
+
+    bool operator()(const type_impl_base& a, const type_impl_base& b) const
+    {
+        return a.kind() == b.kind() && a.equals(b);
+    }
+
+    bool operator()(const type_impl_base& a, const function_key& b) const
+    {
+        if (a.kind() != type_kind::Function) return false;
+
+        auto& that = static_cast<const function_ty&>(a);
+        return that.arguments == b.arguments && that.result == b.result;
+    }
+
+    bool operator()(const type_impl_base& a, const intersection_key& b) const
+    {
+        if (a.kind() != type_kind::Intersection) return false;
+
+        auto& that = static_cast<const intersection_ty&>(a);
+        return that.members == b.members;
+    }
+
+    bool operator()(const type_impl_base& a, const atomic_key& b) const
+    {
+        return a.kind() == b.kind;
+    }
+};
+
+// Types may be made on any thread. The interner is sharded, so threads
+// making different types rarely wait for each other.
+using interner_t = util::concurrent_weak_unordered_set<type_impl_base,
+                                                       type_impl_hash,
+                                                       type_impl_equal>;
+
+// Grows and sweeps away dead types incrementally, so that no single
+// make() has to stop and visit every type in its shard, and shrinks
+// once most of the types are gone.
+struct interner_table : interner_t
+{
+    interner_table()
+    {
+        set_rehash_step(16);
+        set_sweep_step(4);
+        set_shrink_at_ratio(0.125);
+    }
+};
+
+interner_t& interner()
+{
+    static interner_table table;
+    return table;
+}
+
+// A small direct-mapped cache of the types this thread made recently,
+// checked before the shared interner, so that a thread remaking the
+// same types reads only memory of its own. Entries hold weak pointers:
+// they don't keep types alive, and an entry whose type has died just
+// misses.
+class front_cache
+{
+public:
+    template <class K>
+    type::pimpl_t find(const K& key, size_t hash_code) const
+    {
+        const entry& e = entries_[index_(hash_code)];
+        if (e.hash_code != hash_code) return nullptr;
+
+        auto ty = e.ty.lock();
+        if (ty && type_impl_equal()(*ty, key)) return ty;
+        return nullptr;
+    }
+
+    void remember(const type::pimpl_t& ty, size_t hash_code)
+    {
+        entry& e = entries_[index_(hash_code)];
+        e.hash_code = hash_code;
+        e.ty = ty;
+    }
+
+private:
+    static constexpr size_t bits_ = 8;
+
+    struct entry {
+        size_t hash_code = 0;
+        std::weak_ptr<const type_impl_base> ty;
+    };
+
+    entry entries_[size_t(1) << bits_];
+
+    static size_t index_(size_t hash_code)
+    {
+        return (hash_code * size_t(0x9E3779B97F4A7C15))
+               >> (sizeof(size_t) * CHAR_BIT - bits_);
+    }
+};
+
+front_cache& this_thread_cache()
+{
+    thread_local front_cache cache;
+    return cache;
+}
+
+// Looks `key` up in this thread's cache and then the interner, making
+// the node with `make_node` only if neither has it.
+template <class K, class F>
+type::pimpl_t find_or_make(const K& key, F make_node)
+{
+    size_t hash_code = type_impl_hash()(key);
+
+    auto& cache = this_thread_cache();
+    if (auto ty = cache.find(key, hash_code)) return ty;
+
+    auto ty = interner().find_or_insert(key, hash_code, make_node);
+    cache.remember(ty, hash_code);
+    return ty;
+}
+
+} // end anonymous namespace
+
+type type::intern_(pimpl_t candidate)
+{
+    size_t hash_code = candidate->hash();
+
+    auto& cache = this_thread_cache();
+    if (auto ty = cache.find(*candidate, hash_code)) return type(ty);
+
+    auto ty = interner().find_or_insert(*candidate, hash_code, [&] {
+        return candidate;
+    });
+    cache.remember(ty, hash_code);
+    return type(std::move(ty));
+}
+
+type type::make_function_(const std::vector<type>& arguments,
+                          const type& result)
+{
+    return type(find_or_make(function_key{arguments, result}, [&] {
+        return std::make_shared<const function_ty>(arguments, result);
+    }));
+}
+
+type type::make_intersection_(std::vector<type> members)
+{
+    return type(find_or_make(intersection_key{members}, [&] {
+        return std::make_shared<const intersection_ty>(std::move(members));
+    }));
+}
+
+type type::make_atomic_(type_kind kind, pimpl_t (*make_node)())
+{
+    return type(find_or_make(atomic_key{kind}, make_node));
+}
+
 std::ostream& operator<<(std::ostream& o, const type& ty)
 {
     ty.pimpl_->format(o);
@@ -24,14 +243,83 @@ void real_ty::format(std::ostream& o) const
     o << "Real";
 }
 
+void top_ty::format(std::ostream& o) const
+{
+    o << "Top";
+}
+
 function_ty::function_ty(std::vector<type> as, type r)
         : arguments(std::move(as)), result(std::move(r))
-{ }
+{
+    hash_code_ = hash_function(arguments, result);
+}
 
 void function_ty::format(std::ostream& o) const
 {
     o << '(' << Separated{arguments} << ") -> " << result;
 }
 
+type_kind function_ty::kind() const
+{
+    return type_kind::Function;
+}
+
+size_t function_ty::hash() const
+{
+    return hash_code_;
+}
+
+bool function_ty::equals(const type_impl_base& other) const
+{
+    auto& that = static_cast<const function_ty&>(other);
+    return arguments == that.arguments && result == that.result;
+}
+
+intersection_ty::intersection_ty(std::vector<type> ms)
+        : members(std::move(ms))
+        , hash_code_(hash_types(size_t(type_kind::Intersection), members))
+{ }
+
+// The arrow binds more loosely than &, so function members need
+// parentheses.
+void intersection_ty::format(std::ostream& o) const
+{
+    if (members.empty()) {
+        o << "Top";
+        return;
+    }
+
+    bool first_time = true;
+
+    for (const auto& member : members) {
+        if (first_time) {
+            first_time = false;
+        } else {
+            o << " & ";
+        }
+
+        if (member.kind() == type_kind::Function)
+            o << '(' << member << ')';
+        else
+            o << member;
+    }
+}
+
+type_kind intersection_ty::kind() const
+{
+    return type_kind::Intersection;
+}
+
+size_t intersection_ty::hash() const
+{
+    return hash_code_;
+}
+
+bool intersection_ty::equals(const type_impl_base& other) const
+{
+    auto& that = static_cast<const intersection_ty&>(other);
+    return members == that.members;
+}
+
 } // end namespace intersections
 
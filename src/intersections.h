@@ -1,24 +1,91 @@
 #pragma once
 
+#include <cstddef>
 #include <iostream>
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 namespace intersections {
 
+enum class type_kind
+{
+    Int,
+    Double,
+    Real,
+    Top,
+    Function,
+    Intersection,
+};
+
+constexpr size_t number_of_type_kinds = 6;
+
 struct type_impl_base {
     virtual void format(std::ostream&) const = 0;
+    virtual type_kind kind() const = 0;
+    /// Structural hash code; children contribute their own hash codes.
+    virtual size_t hash() const = 0;
+    /// Structural equality. PRECONDITION: `other.kind() == kind()`.
+    virtual bool equals(const type_impl_base& other) const = 0;
     virtual ~type_impl_base() = default;
 };
 
+struct function_ty;
+struct intersection_ty;
+
+/// Whether T is one of the atomic types, which have no parts.
+template <class T, class = void>
+constexpr bool is_atomic_ty = false;
+
+template <class T>
+constexpr bool is_atomic_ty<T, std::void_t<decltype(T::atomic_kind)>> = true;
+
+/// Types are hash-consed: `make` returns the existing node for a
+/// structurally equal type if one is alive, so two types are equal just
+/// when they share a node.
 class type {
 public:
-    using pimpl_t = std::shared_ptr<type_impl_base>;
+    using pimpl_t = std::shared_ptr<const type_impl_base>;
 
     template <class Derived, class... Args>
     static type make(Args&&... args)
     {
-        return type(std::make_shared<Derived>(std::forward<Args>(args)...));
+        if constexpr (std::is_same_v<Derived, function_ty>) {
+            return make_function_(std::forward<Args>(args)...);
+        } else if constexpr (std::is_same_v<Derived, intersection_ty>) {
+            return make_intersection_(std::forward<Args>(args)...);
+        } else if constexpr (is_atomic_ty<Derived>) {
+            static_assert(sizeof...(Args) == 0,
+                          "atomic types take no arguments");
+            return make_atomic_(Derived::atomic_kind, [] {
+                return pimpl_t(std::make_shared<const Derived>());
+            });
+        } else {
+            return intern_(std::make_shared<const Derived>(
+                    std::forward<Args>(args)...));
+        }
+    }
+
+    type_kind kind() const
+    {
+        return pimpl_->kind();
+    }
+
+    /// PRECONDITION: this type's node is a `Derived`.
+    template <class Derived>
+    const Derived& as() const
+    {
+        return static_cast<const Derived&>(*pimpl_);
+    }
+
+    size_t hash() const
+    {
+        return pimpl_->hash();
+    }
+
+    const pimpl_t& impl() const
+    {
+        return pimpl_;
     }
 
 private:
@@ -26,19 +93,68 @@ private:
 
     explicit type(pimpl_t pimpl) : pimpl_(std::move(pimpl)) {}
 
+    static type intern_(pimpl_t);
+
+    // These look up the type before making a node for it, so that making
+    // an existing type allocates nothing.
+
+    static type make_function_(const std::vector<type>& arguments,
+                               const type& result);
+
+    static type make_intersection_(std::vector<type> members);
+
+    static type make_atomic_(type_kind, pimpl_t (*make_node)());
+
+    friend class simplifier;
+
+    friend bool operator==(const type& a, const type& b)
+    {
+        return a.pimpl_ == b.pimpl_;
+    }
+
+    friend bool operator!=(const type& a, const type& b)
+    {
+        return a.pimpl_ != b.pimpl_;
+    }
+
     friend std::ostream& operator<<(std::ostream&, const type&);
 };
 
 
-struct int_ty : type_impl_base {
+template <type_kind Kind>
+struct atomic_ty : type_impl_base {
+    static constexpr type_kind atomic_kind = Kind;
+
+    type_kind kind() const override
+    {
+        return Kind;
+    }
+
+    size_t hash() const override
+    {
+        return size_t(Kind);
+    }
+
+    bool equals(const type_impl_base&) const override
+    {
+        return true;
+    }
+};
+
+struct int_ty : atomic_ty<type_kind::Int> {
     void format(std::ostream&) const override;
 };
 
-struct double_ty : type_impl_base {
+struct double_ty : atomic_ty<type_kind::Double> {
     void format(std::ostream&) const override;
 };
 
-struct real_ty : type_impl_base {
+struct real_ty : atomic_ty<type_kind::Real> {
+    void format(std::ostream&) const override;
+};
+
+/// The empty intersection, which every type inhabits.
+struct top_ty : atomic_ty<type_kind::Top> {
     void format(std::ostream&) const override;
 };
 
@@ -49,6 +165,39 @@ struct function_ty : type_impl_base {
     type result;
 
     void format(std::ostream&) const override;
+    type_kind kind() const override;
+    size_t hash() const override;
+    bool equals(const type_impl_base&) const override;
+
+private:
+    size_t hash_code_;
+};
+
+struct intersection_ty : type_impl_base {
+    explicit intersection_ty(std::vector<type>);
+
+    std::vector<type> members;
+
+    void format(std::ostream&) const override;
+    type_kind kind() const override;
+    size_t hash() const override;
+    bool equals(const type_impl_base&) const override;
+
+private:
+    size_t hash_code_;
 };
 
 } // end namespace intersections
+
+namespace std {
+
+template <>
+struct hash<intersections::type>
+{
+    size_t operator()(const intersections::type& ty) const
+    {
+        return ty.hash();
+    }
+};
+
+} // end namespace std
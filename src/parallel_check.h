@@ -0,0 +1,40 @@
+#pragma once
+
+#include "util/work_stealing_pool.h"
+
+#include <type_traits>
+#include <vector>
+
+namespace intersections {
+
+/// Checks independent definitions on `pool`, where `check(definition)`
+/// returns a vector of diagnostics. The diagnostics are merged in the
+/// order of `definitions`, regardless of the order in which the checks
+/// finish.
+///
+/// Checks may run concurrently, so they may share interned types but
+/// nothing else mutable: each check should use its own simplifier and
+/// other caches.
+template <class Definition, class Check>
+auto check_in_parallel(const std::vector<Definition>& definitions,
+                       Check check,
+                       util::work_stealing_pool& pool)
+{
+    using diagnostics_t = std::invoke_result_t<Check&, const Definition&>;
+
+    std::vector<diagnostics_t> per_definition(definitions.size());
+
+    pool.parallel_for(definitions.size(), [&](size_t i) {
+        per_definition[i] = check(definitions[i]);
+    });
+
+    diagnostics_t merged;
+    for (auto& diagnostics : per_definition) {
+        for (auto& diagnostic : diagnostics)
+            merged.push_back(std::move(diagnostic));
+    }
+
+    return merged;
+}
+
+} // end namespace intersections
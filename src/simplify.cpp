@@ -0,0 +1,260 @@
+#include "simplify.h"
+
+#include <algorithm>
+
+namespace intersections {
+
+namespace {
+
+using members_t = std::vector<type>;
+
+const members_t& members_of(const type& ty)
+{
+    return ty.as<intersection_ty>().members;
+}
+
+type top()
+{
+    return type::make<top_ty>();
+}
+
+// (A & B) & C  =>  A & B & C
+std::optional<type> flatten(const type& ty)
+{
+    members_t members;
+
+    for (const auto& member : members_of(ty)) {
+        if (member.kind() == type_kind::Intersection) {
+            auto const& inner = members_of(member);
+            members.insert(members.end(), inner.begin(), inner.end());
+        } else {
+            members.push_back(member);
+        }
+    }
+
+    return type::make<intersection_ty>(std::move(members));
+}
+
+// A & Top  =>  A
+std::optional<type> drop_top(const type& ty)
+{
+    members_t members;
+
+    for (const auto& member : members_of(ty)) {
+        if (member.kind() != type_kind::Top)
+            members.push_back(member);
+    }
+
+    return type::make<intersection_ty>(std::move(members));
+}
+
+// A & B & A  =>  A & B
+std::optional<type> idempotence(const type& ty)
+{
+    members_t members;
+
+    for (const auto& member : members_of(ty)) {
+        if (std::find(members.begin(), members.end(), member) == members.end())
+            members.push_back(member);
+    }
+
+    if (members.size() == members_of(ty).size())
+        return std::nullopt;
+
+    return type::make<intersection_ty>(std::move(members));
+}
+
+// &()  =>  Top,  &(A)  =>  A
+std::optional<type> singleton(const type& ty)
+{
+    auto const& members = members_of(ty);
+
+    switch (members.size()) {
+        case 0:
+            return top();
+        case 1:
+            return members.front();
+        default:
+            return std::nullopt;
+    }
+}
+
+// (A...) -> Top  =>  Top
+std::optional<type> absorb_top(const type& ty)
+{
+    if (ty.as<function_ty>().result.kind() == type_kind::Top)
+        return top();
+    else
+        return std::nullopt;
+}
+
+// ((A...) -> B) & ((A...) -> C)  =>  (A...) -> B & C
+std::optional<type> distribute(const type& ty)
+{
+    members_t members = members_of(ty);
+
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (members[i].kind() != type_kind::Function) continue;
+        auto const& f = members[i].as<function_ty>();
+
+        for (size_t j = i + 1; j < members.size(); ++j) {
+            if (members[j].kind() != type_kind::Function) continue;
+            auto const& g = members[j].as<function_ty>();
+
+            if (f.arguments != g.arguments) continue;
+
+            auto result = type::make<intersection_ty>(
+                    members_t{f.result, g.result});
+            members[i] = type::make<function_ty>(f.arguments, result);
+            members.erase(members.begin() + j);
+            return type::make<intersection_ty>(std::move(members));
+        }
+    }
+
+    return std::nullopt;
+}
+
+} // end anonymous namespace
+
+const std::vector<rewrite_rule>& simplifier::default_rules()
+{
+    static const std::vector<rewrite_rule> rules{
+        {"flatten", type_kind::Intersection,
+         kind_bit(type_kind::Intersection), flatten},
+        {"drop-top", type_kind::Intersection,
+         kind_bit(type_kind::Top), drop_top},
+        {"idempotence", type_kind::Intersection, 0, idempotence},
+        {"singleton", type_kind::Intersection, 0, singleton},
+        {"absorb-top", type_kind::Function,
+         kind_bit(type_kind::Top), absorb_top},
+        {"distribute", type_kind::Intersection,
+         kind_bit(type_kind::Function), distribute},
+    };
+
+    return rules;
+}
+
+simplifier::simplifier(std::vector<rewrite_rule> rules, size_t max_steps)
+        : rules_(std::move(rules)), max_steps_(max_steps)
+{
+    compile_();
+}
+
+type simplifier::operator()(const type& ty)
+{
+    fuel_ = max_steps_;
+    return normalize_(ty);
+}
+
+void simplifier::compile_()
+{
+    offsets_.clear();
+    dispatch_.clear();
+
+    for (size_t state = 0; state < number_of_states_; ++state) {
+        auto head = type_kind(state >> number_of_type_kinds);
+        auto children = kind_set(state & ((1 << number_of_type_kinds) - 1));
+
+        offsets_.push_back(dispatch_.size());
+
+        for (size_t i = 0; i < rules_.size(); ++i) {
+            auto const& rule = rules_[i];
+            if (rule.head == head && (rule.needs & ~children) == 0)
+                dispatch_.push_back(i);
+        }
+    }
+
+    offsets_.push_back(dispatch_.size());
+}
+
+size_t simplifier::state_of_(const type& ty)
+{
+    kind_set children = 0;
+
+    switch (ty.kind()) {
+        case type_kind::Function: {
+            auto const& f = ty.as<function_ty>();
+            for (const auto& arg : f.arguments)
+                children |= kind_bit(arg.kind());
+            children |= kind_bit(f.result.kind());
+            break;
+        }
+
+        case type_kind::Intersection:
+            for (const auto& member : members_of(ty))
+                children |= kind_bit(member.kind());
+            break;
+
+        default:
+            break;
+    }
+
+    return (size_t(ty.kind()) << number_of_type_kinds) | children;
+}
+
+type simplifier::normalize_(const type& ty)
+{
+    if (auto cached = memo_.cached(ty.impl()))
+        return type(std::move(*cached));
+
+    type current = normalize_children_(ty);
+
+    for (bool changed = true; changed && fuel_ > 0; ) {
+        changed = false;
+
+        size_t state = state_of_(current);
+        for (size_t i = offsets_[state]; i < offsets_[state + 1]; ++i) {
+            if (auto rewritten = rules_[dispatch_[i]].apply(current)) {
+                --fuel_;
+                ++steps_;
+                current = normalize_children_(*rewritten);
+                changed = true;
+                break;
+            }
+        }
+    }
+
+    // Only a type we finished with is known to be in normal form.
+    if (fuel_ > 0) {
+        memo_.remember(ty.impl(), current.impl());
+        if (current != ty) memo_.remember(current.impl(), current.impl());
+    }
+
+    return current;
+}
+
+type simplifier::normalize_children_(const type& ty)
+{
+    switch (ty.kind()) {
+        case type_kind::Function: {
+            auto const& f = ty.as<function_ty>();
+
+            members_t arguments;
+            for (const auto& arg : f.arguments)
+                arguments.push_back(normalize_(arg));
+            auto result = normalize_(f.result);
+
+            if (arguments == f.arguments && result == f.result)
+                return ty;
+
+            return type::make<function_ty>(std::move(arguments),
+                                           std::move(result));
+        }
+
+        case type_kind::Intersection: {
+            members_t members;
+            for (const auto& member : members_of(ty))
+                members.push_back(normalize_(member));
+
+            if (members == members_of(ty))
+                return ty;
+
+            return type::make<intersection_ty>(std::move(members));
+        }
+
+        default:
+            return ty;
+    }
+}
+
+} // end namespace intersections
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "intersections.h"
+#include "util/memoize.h"
+
+#include <optional>
+#include <vector>
+
+namespace intersections {
+
+/// A set of type kinds, one bit per kind.
+using kind_set = unsigned;
+
+constexpr kind_set kind_bit(type_kind kind)
+{
+    return kind_set(1) << size_t(kind);
+}
+
+/// An algebraic rewrite rule. It is tried only on types whose kind is
+/// `head` and whose immediate children include every kind in `needs`,
+/// and returns the rewritten type, or nothing if it doesn't apply.
+struct rewrite_rule {
+    const char* name;
+    type_kind head;
+    kind_set needs;
+    std::optional<type> (*apply)(const type&);
+};
+
+/// Rewrites types to normal form with a fixed set of rules.
+///
+/// The rules are compiled into a dispatch automaton whose states are
+/// (head kind, set of child kinds) pairs, so each node is matched only
+/// against the rules that can fire on it. Normal forms are memoized per
+/// interned node.
+class simplifier {
+public:
+    /// Flattening, the Top unit, idempotence, singletons, Top absorption,
+    /// and distributing intersections over function results.
+    static const std::vector<rewrite_rule>& default_rules();
+
+    /// `max_steps` bounds the number of rewrites performed by one call to
+    /// operator(); a call that runs out returns a partially simplified
+    /// type.
+    explicit simplifier(std::vector<rewrite_rule> rules = default_rules(),
+                        size_t max_steps = 1 << 16);
+
+    /// Returns the normal form of `ty`.
+    type operator()(const type& ty);
+
+    /// The total number of rewrites performed.
+    size_t steps() const
+    {
+        return steps_;
+    }
+
+private:
+    static constexpr size_t number_of_states_ =
+            number_of_type_kinds << number_of_type_kinds;
+
+    std::vector<rewrite_rule> rules_;
+
+    // The automaton: the rules to try in state s are rules_[dispatch_[i]]
+    // for offsets_[s] <= i < offsets_[s + 1].
+    std::vector<size_t> offsets_;
+    std::vector<size_t> dispatch_;
+
+    // Types are hash-consed, so they're memoized by address.
+    util::memoize<type::pimpl_t(type::pimpl_t),
+                  util::address_hash<type_impl_base>,
+                  util::address_equal<type_impl_base>> memo_;
+
+    size_t max_steps_;
+    size_t fuel_ = 0;
+    size_t steps_ = 0;
+
+    void compile_();
+    type normalize_(const type&);
+    type normalize_children_(const type&);
+    static size_t state_of_(const type&);
+};
+
+} // end namespace intersections
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "weak_unordered_set.h"
+
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace intersections::util {
+
+/// A weak_unordered_set that may be used from many threads at once. Keys
+/// are partitioned into shards by the high bits of their hash codes,
+/// once mixed, each shard a weak_unordered_set with its own lock, so
+/// threads contend only when they touch the same shard. Each shard
+/// grows, shrinks and sweeps away expired elements on its own.
+///
+/// Mixing spreads hash codes that differ only in their low bits, like
+/// std::hash of small integers, over all the shards. The shards see the
+/// whole, unmixed hash code.
+template <
+    class Key,
+    class Hash = std::hash<Key>,
+    class KeyEqual = std::equal_to<Key>,
+    class Allocator = std::allocator<Key>,
+    class SizePolicy = power_of_two_sizing
+>
+class concurrent_weak_unordered_set
+{
+public:
+    using shard_type = weak_unordered_set<Key, Hash, KeyEqual, Allocator,
+                                          SizePolicy>;
+    using key_type          = Key;
+    using strong_value_type = typename shard_type::strong_value_type;
+    using hasher            = Hash;
+    using key_equal         = KeyEqual;
+    using allocator_type    = Allocator;
+
+    /// Constructs a new, empty set with the given number of shards,
+    /// rounded up to a power of two. The default is four per hardware
+    /// thread, which keeps contention low without spreading small sets
+    /// too thin.
+    explicit concurrent_weak_unordered_set(
+            size_t shard_count = default_shard_count(),
+            const hasher& hash = hasher(),
+            const key_equal& equal = key_equal(),
+            const allocator_type& allocator = allocator_type())
+        : hash_(hash)
+    {
+        while ((size_t(1) << shard_bits_) < shard_count) ++shard_bits_;
+
+        shards_.reserve(size_t(1) << shard_bits_);
+        for (size_t i = 0; i < size_t(1) << shard_bits_; ++i) {
+            shards_.push_back(std::make_unique<shard>(
+                    default_bucket_count, hash, equal, allocator));
+        }
+    }
+
+    concurrent_weak_unordered_set(const concurrent_weak_unordered_set&)
+            = delete;
+    concurrent_weak_unordered_set&
+    operator=(const concurrent_weak_unordered_set&) = delete;
+
+    static size_t default_shard_count()
+    {
+        size_t threads = std::thread::hardware_concurrency();
+        return 4 * (threads == 0 ? 1 : threads);
+    }
+
+    size_t shard_count() const
+    {
+        return shards_.size();
+    }
+
+    /// Which shard holds the keys with the given hash code.
+    size_t shard_index(size_t hash_code) const
+    {
+        // Shifting in two steps keeps a single shard from shifting by the
+        // full width of size_t.
+        constexpr size_t bits = sizeof(size_t) * CHAR_BIT;
+        size_t mixed = hash_code * size_t(0x9E3779B97F4A7C15);
+        return mixed >> (bits - 1 - shard_bits_) >> 1;
+    }
+
+    /// Like size() on each shard, this counts elements that have expired
+    /// but haven't been removed yet. Since other threads may be inserting
+    /// and erasing meanwhile, it's only a snapshot.
+    size_t size() const
+    {
+        size_t result = 0;
+
+        for (const auto& each : shards_) {
+            std::lock_guard<std::mutex> lock(each->mutex);
+            result += each->set.size();
+        }
+
+        return result;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /// The number of buckets, summed over the shards.
+    size_t bucket_count() const
+    {
+        size_t result = 0;
+
+        for (const auto& each : shards_) {
+            std::lock_guard<std::mutex> lock(each->mutex);
+            result += each->set.bucket_count();
+        }
+
+        return result;
+    }
+
+    // These configure every shard; see weak_unordered_set.
+
+    void set_rehash_step(size_t step)
+    {
+        for_each_shard_([=](shard_type& set) { set.set_rehash_step(step); });
+    }
+
+    void set_sweep_step(size_t step)
+    {
+        for_each_shard_([=](shard_type& set) { set.set_sweep_step(step); });
+    }
+
+    void set_shrink_at_ratio(double ratio)
+    {
+        for_each_shard_([=](shard_type& set) {
+            set.set_shrink_at_ratio(ratio);
+        });
+    }
+
+    /// Makes room for `count` elements, assuming that they spread evenly
+    /// over the shards.
+    void reserve(size_t count)
+    {
+        size_t per_shard = (count + shard_count() - 1) / shard_count();
+        for_each_shard_([=](shard_type& set) { set.reserve(per_shard); });
+    }
+
+    /// Gives each shard an equal part of a retention window of `count`
+    /// elements. Since each shard keeps its own, how long an element
+    /// lasts depends on the hits to its shard, not to the whole set.
+    void set_retention_window(size_t count)
+    {
+        size_t per_shard = (count + shard_count() - 1) / shard_count();
+        for_each_shard_([=](shard_type& set) {
+            set.set_retention_window(per_shard);
+        });
+    }
+
+    void clear()
+    {
+        for_each_shard_([](shard_type& set) { set.clear(); });
+    }
+
+    /// Cleans up expired elements, one shard at a time, so other threads
+    /// can carry on with the rest meanwhile.
+    void remove_expired()
+    {
+        for_each_shard_([](shard_type& set) { set.remove_expired(); });
+    }
+
+    /// Like remove_expired(), but cleans up the shards in parallel on
+    /// `pool`. Must not be called from one of the pool's threads.
+    void remove_expired(work_stealing_pool& pool)
+    {
+        pool.parallel_for(shards_.size(), [&](size_t i) {
+            std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+            shards_[i]->set.remove_expired();
+        });
+    }
+
+    void insert(const strong_value_type& value)
+    {
+        auto& s = shard_(hash_(*value));
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.set.insert(value);
+    }
+
+    /// Returns the element with the given key, if there is one. Otherwise
+    /// inserts and returns `factory()`. Holds the lock on the key's shard
+    /// throughout, so when threads race to insert equal keys, they all
+    /// get the same element back. The factory must not use this set.
+    template <class K, class F>
+    strong_value_type find_or_insert(const K& key, F&& factory)
+    {
+        return find_or_insert(key, hash_(key), std::forward<F>(factory));
+    }
+
+    template <class K, class F>
+    strong_value_type find_or_insert(const K& key, size_t hash_code,
+                                     F&& factory)
+    {
+        auto& s = shard_(hash_code);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.set.find_or_insert(key, hash_code, std::forward<F>(factory));
+    }
+
+    /// Returns the element equal to `Key(args...)`, inserting a new one
+    /// if there is none.
+    template <class... Args>
+    strong_value_type try_emplace(Args&&... args)
+    {
+        Key key(std::forward<Args>(args)...);
+        return find_or_insert(key, [&] {
+            return std::make_shared<const Key>(std::move(key));
+        });
+    }
+
+    bool erase(const key_type& key)
+    {
+        auto& s = shard_(hash_(key));
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.set.erase(key);
+    }
+
+    template <class K>
+    bool member(const K& key) const
+    {
+        return member(key, hash_(key));
+    }
+
+    template <class K>
+    bool member(const K& key, size_t hash_code) const
+    {
+        auto& s = shard_(hash_code);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        return s.set.member(key, hash_code);
+    }
+
+    template <class K>
+    size_t count(const K& key) const
+    {
+        return member(key)? 1 : 0;
+    }
+
+private:
+    // Each shard gets its own cache line, so that locking one doesn't
+    // slow down threads working on its neighbors.
+    struct alignas(64) shard
+    {
+        template <class... Args>
+        explicit shard(Args&&... args)
+                : set(std::forward<Args>(args)...)
+        { }
+
+        mutable std::mutex mutex;
+        shard_type set;
+    };
+
+    Hash hash_;
+    size_t shard_bits_ = 0;
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    shard& shard_(size_t hash_code) const
+    {
+        return *shards_[shard_index(hash_code)];
+    }
+
+    template <class F>
+    void for_each_shard_(F f)
+    {
+        for (auto& each : shards_) {
+            std::lock_guard<std::mutex> lock(each->mutex);
+            f(each->set);
+        }
+    }
+};
+
+} // end namespace intersections::util
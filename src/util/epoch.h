@@ -0,0 +1,200 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace intersections::util {
+
+/// Epoch-based reclamation, for freeing memory that lock-free readers may
+/// still be looking at. Readers hold an epoch_guard while they use shared
+/// memory. Writers first unlink memory so that no new reader can reach
+/// it, then retire() it, and it's freed once every reader that might
+/// have seen it has left.
+///
+/// There is one domain for the whole process. Each thread takes a record
+/// the first time it reads, and leaves it for reuse when it exits.
+class epoch_domain
+{
+public:
+    static epoch_domain& global()
+    {
+        static epoch_domain domain;
+        return domain;
+    }
+
+    epoch_domain(const epoch_domain&) = delete;
+    epoch_domain& operator=(const epoch_domain&) = delete;
+
+    /// By now no thread should be reading, so everything retired goes.
+    ~epoch_domain()
+    {
+        for (auto& each : retired_)
+            each.second();
+
+        for (record* rec = records_.load(); rec != nullptr; ) {
+            record* next = rec->next;
+            delete rec;
+            rec = next;
+        }
+    }
+
+    /// Announces that this thread is reading.
+    void enter()
+    {
+        record& rec = this_thread_record_();
+        if (rec.depth++ > 0) return;
+
+        // If the epoch moves on between reading and announcing it, then
+        // announce the new one, since a writer may already have looked
+        // for readers without seeing this one.
+        uint64_t epoch = epoch_.load();
+        for (;;) {
+            rec.epoch.store(epoch);
+            uint64_t now = epoch_.load();
+            if (now == epoch) return;
+            epoch = now;
+        }
+    }
+
+    void leave()
+    {
+        record& rec = this_thread_record_();
+        if (--rec.depth == 0) rec.epoch.store(idle, std::memory_order_release);
+    }
+
+    /// Arranges for `deleter` to run once no reader can still see the
+    /// memory it frees, which must already be unreachable for new readers.
+    /// May run it, and other deleters retired earlier, right away.
+    void retire(std::function<void()> deleter)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            retired_.emplace_back(epoch_.load(), std::move(deleter));
+        }
+
+        reclaim();
+    }
+
+    /// Runs the deleters that no reader can be waiting on any more.
+    void reclaim()
+    {
+        std::vector<std::function<void()>> ready;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            try_advance_();
+
+            // Readers that saw retired memory announced its epoch or an
+            // earlier one, so two advances later they've all left.
+            uint64_t epoch = epoch_.load();
+            auto keep = retired_.begin();
+            for (auto& each : retired_) {
+                if (each.first + 2 <= epoch)
+                    ready.push_back(std::move(each.second));
+                else
+                    *keep++ = std::move(each);
+            }
+            retired_.erase(keep, retired_.end());
+        }
+
+        for (auto& deleter : ready)
+            deleter();
+    }
+
+    /// The number of deleters still waiting to run.
+    size_t retired_count() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return retired_.size();
+    }
+
+private:
+    static constexpr uint64_t idle = 0;
+
+    // Each record gets its own cache line, so that readers announcing
+    // themselves don't slow each other down.
+    struct alignas(64) record
+    {
+        std::atomic<uint64_t> epoch{idle};
+        std::atomic<bool> in_use{true};
+        size_t depth = 0;
+        record* next = nullptr;
+    };
+
+    // Gives the thread's record back when the thread exits.
+    struct thread_record
+    {
+        record* rec = nullptr;
+
+        ~thread_record()
+        {
+            if (rec) rec->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    epoch_domain() = default;
+
+    std::atomic<uint64_t> epoch_{idle + 1};
+    std::atomic<record*> records_{nullptr};
+
+    mutable std::mutex mutex_;
+    std::vector<std::pair<uint64_t, std::function<void()>>> retired_;
+
+    record& this_thread_record_()
+    {
+        static thread_local thread_record mine;
+        if (!mine.rec) mine.rec = acquire_record_();
+        return *mine.rec;
+    }
+
+    record* acquire_record_()
+    {
+        for (record* rec = records_.load(); rec != nullptr; rec = rec->next) {
+            bool expected = false;
+            if (rec->in_use.compare_exchange_strong(expected, true))
+                return rec;
+        }
+
+        auto rec = new record;
+        rec->next = records_.load();
+        while (!records_.compare_exchange_weak(rec->next, rec)) { }
+        return rec;
+    }
+
+    // Moves to the next epoch if every reader has announced this one.
+    void try_advance_()
+    {
+        uint64_t epoch = epoch_.load();
+
+        for (record* rec = records_.load(); rec != nullptr; rec = rec->next) {
+            uint64_t seen = rec->epoch.load();
+            if (seen != idle && seen != epoch) return;
+        }
+
+        epoch_.compare_exchange_strong(epoch, epoch + 1);
+    }
+};
+
+/// Marks the current thread as reading for its lifetime. Guards nest.
+class epoch_guard
+{
+public:
+    epoch_guard()
+    {
+        epoch_domain::global().enter();
+    }
+
+    ~epoch_guard()
+    {
+        epoch_domain::global().leave();
+    }
+
+    epoch_guard(const epoch_guard&) = delete;
+    epoch_guard& operator=(const epoch_guard&) = delete;
+};
+
+} // end namespace intersections::util
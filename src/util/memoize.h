@@ -0,0 +1,241 @@
+#pragma once
+
+#include "weak_identity.h"
+#include "weak_unordered_set.h"
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+
+namespace intersections::util {
+
+namespace memoize_detail {
+
+template <class T>
+struct shared_element
+{
+    static constexpr bool is_shared = false;
+};
+
+template <class T>
+struct shared_element<std::shared_ptr<T>>
+{
+    static constexpr bool is_shared = true;
+    using type = std::remove_const_t<T>;
+};
+
+// With address_equal, a shared argument is known by its address, which
+// the table keeps in the bucket (see weak_identity.h), so that looking
+// it up never locks the argument's weak pointer.
+template <class Table, class KeyEqual>
+struct by_address
+{
+    using type = Table;
+};
+
+template <class Table, class T>
+struct by_address<Table, address_equal<T>>
+{
+    using type = rh_weak_hash_table<
+            identity_keyed<typename Table::weak_value_type>,
+            typename Table::hasher, address_equal<T>,
+            typename Table::allocator_type, typename Table::size_policy>;
+};
+
+// Chooses the weak table that caches a function from Arg to Result:
+//
+//  - shared argument, plain result: weak_key_unordered_map, so an entry
+//    lives as long as its argument;
+//  - shared argument, shared result: weak_unordered_map, so an entry lives
+//    as long as both (a strongly held result that refers back to its
+//    argument would otherwise keep the entry alive forever);
+//  - plain argument, shared result: weak_value_unordered_map, so an entry
+//    lives as long as someone else holds its result.
+template <class Result, class Arg,
+          bool = shared_element<Arg>::is_shared,
+          bool = shared_element<Result>::is_shared>
+struct memo_table
+{
+    static_assert(shared_element<Arg>::is_shared ||
+                  shared_element<Result>::is_shared,
+                  "memoize needs a shared argument or result; "
+                  "use rh_unordered_map for strong caches");
+};
+
+template <class Result, class Arg>
+struct memo_table<Result, Arg, true, false>
+{
+    using key_type = typename shared_element<Arg>::type;
+
+    template <class Hash, class KeyEqual>
+    using type = typename by_address<
+            weak_key_unordered_map<key_type, Result, Hash, KeyEqual>,
+            KeyEqual>::type;
+
+    static const key_type& key(const Arg& arg)
+    {
+        return *arg;
+    }
+};
+
+template <class Result, class Arg>
+struct memo_table<Result, Arg, true, true>
+{
+    using key_type = typename shared_element<Arg>::type;
+
+    template <class Hash, class KeyEqual>
+    using type = typename by_address<
+            weak_unordered_map<key_type, typename Result::element_type,
+                               Hash, KeyEqual>,
+            KeyEqual>::type;
+
+    static const key_type& key(const Arg& arg)
+    {
+        return *arg;
+    }
+};
+
+template <class Result, class Arg>
+struct memo_table<Result, Arg, false, true>
+{
+    using key_type = Arg;
+
+    template <class Hash, class KeyEqual>
+    using type = weak_value_unordered_map<
+            key_type, typename Result::element_type, Hash, KeyEqual>;
+
+    static const key_type& key(const Arg& arg)
+    {
+        return arg;
+    }
+};
+
+template <class Signature>
+struct signature;
+
+template <class Result, class Arg>
+struct signature<Result(Arg)>
+{
+    using result_type = Result;
+    using argument_type = std::decay_t<Arg>;
+    using selector_t = memo_table<result_type, argument_type>;
+    using key_type = typename selector_t::key_type;
+};
+
+} // end namespace memoize_detail
+
+/// Caches a pure function whose argument or result is held by
+/// `std::shared_ptr`, without keeping either alive. `Signature` is the
+/// function type, as in `memoize<size_t(std::shared_ptr<const Foo>)>`.
+///
+/// If `max_size` is non-zero, the cache is swept of expired entries when
+/// it reaches that size, and flushed if that doesn't free any room.
+///
+/// Callers that need to decide for themselves whether a result is worth
+/// keeping can use `cached` and `remember` directly, in which case the
+/// function may be omitted.
+template <
+    class Signature,
+    class Hash =
+        std::hash<typename memoize_detail::signature<Signature>::key_type>,
+    class KeyEqual =
+        std::equal_to<typename memoize_detail::signature<Signature>::key_type>
+>
+class memoize
+{
+    using signature_t = memoize_detail::signature<Signature>;
+    using selector_t = typename signature_t::selector_t;
+    using Result = typename signature_t::result_type;
+
+public:
+    using argument_type = typename signature_t::argument_type;
+    using result_type = Result;
+    using function_type = std::function<Result(const argument_type&)>;
+    using table_type =
+        typename selector_t::template type<Hash, KeyEqual>;
+
+    explicit memoize(function_type function = nullptr, size_t max_size = 0)
+            : function_(std::move(function)), max_size_(max_size)
+    { }
+
+    /// Returns the cached result for `arg`, computing it on a miss.
+    Result operator()(const argument_type& arg)
+    {
+        if (auto result = cached(arg)) {
+            return *std::move(result);
+        }
+
+        Result result = function_(arg);
+        remember(arg, result);
+        return result;
+    }
+
+    /// Returns the cached result for `arg`, if any, counting a hit or a
+    /// miss.
+    std::optional<Result> cached(const argument_type& arg)
+    {
+        auto iter = table_.find(selector_t::key(arg));
+        if (iter != table_.end()) {
+            ++hits_;
+            return (*iter).second;
+        }
+
+        ++misses_;
+        return std::nullopt;
+    }
+
+    /// Caches `result` as the result for `arg`.
+    void remember(const argument_type& arg, const Result& result)
+    {
+        make_room_();
+        table_.insert({arg, result});
+    }
+
+    /// How many calls were answered from the cache.
+    size_t hits() const
+    {
+        return hits_;
+    }
+
+    /// How many calls had to run the function.
+    size_t misses() const
+    {
+        return misses_;
+    }
+
+    /// An overapproximation of the number of cached results, as with
+    /// rh_weak_hash_table::size().
+    size_t size() const
+    {
+        return table_.size();
+    }
+
+    /// Forgets all cached results, but not the hit and miss counts.
+    void clear()
+    {
+        table_.clear();
+    }
+
+    void reset_stats()
+    {
+        hits_ = misses_ = 0;
+    }
+
+private:
+    function_type function_;
+    table_type table_;
+    size_t max_size_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+
+    void make_room_()
+    {
+        if (max_size_ == 0 || table_.size() < max_size_) return;
+
+        table_.remove_expired();
+        if (table_.size() >= max_size_) table_.clear();
+    }
+};
+
+} // end namespace intersections::util
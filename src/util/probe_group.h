@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if !defined(INTERSECTIONS_SCALAR_PROBE)
+#  if defined(__AVX2__)
+#    include <immintrin.h>
+#    define INTERSECTIONS_PROBE_AVX2 1
+#  elif defined(__SSE2__) || defined(_M_X64)
+#    include <emmintrin.h>
+#    define INTERSECTIONS_PROBE_SSE2 1
+#  endif
+#endif
+
+namespace intersections::util {
+
+/// A control byte describes one bucket: either ctrl_empty, ctrl_deleted,
+/// or the 7-bit hash fragment of the element in the bucket.
+using ctrl_t = std::int8_t;
+
+constexpr ctrl_t ctrl_empty = -128;
+
+/// A bucket whose element has been removed without shifting the rest of
+/// its cluster back, so probes must continue past it.
+constexpr ctrl_t ctrl_deleted = -2;
+
+/// A set of positions within a probe_group, one bit per bucket.
+class group_mask
+{
+public:
+    explicit group_mask(std::uint32_t bits) : bits_(bits) { }
+
+    explicit operator bool() const
+    {
+        return bits_ != 0;
+    }
+
+    /// PRECONDITION: the mask is non-empty.
+    size_t lowest() const
+    {
+        return size_t(__builtin_ctz(bits_));
+    }
+
+    /// Keeps only the positions before `limit`, or all of them if `limit`
+    /// is empty.
+    group_mask before_first(group_mask limit) const
+    {
+        if (!limit) return *this;
+        return group_mask(bits_ & ((limit.bits_ & -limit.bits_) - 1));
+    }
+
+    // Iterating over a group_mask yields the set positions, lowest first.
+    class iterator
+    {
+    public:
+        explicit iterator(std::uint32_t bits) : bits_(bits) { }
+
+        size_t operator*() const
+        {
+            return size_t(__builtin_ctz(bits_));
+        }
+
+        iterator& operator++()
+        {
+            bits_ &= bits_ - 1;
+            return *this;
+        }
+
+        bool operator!=(iterator other) const
+        {
+            return bits_ != other.bits_;
+        }
+
+    private:
+        std::uint32_t bits_;
+    };
+
+    iterator begin() const
+    {
+        return iterator(bits_);
+    }
+
+    iterator end() const
+    {
+        return iterator(0);
+    }
+
+private:
+    std::uint32_t bits_;
+};
+
+/// The control bytes of `width` consecutive buckets, examined at once:
+/// with AVX2 or SSE2 where available, and a byte at a time otherwise.
+/// Defining INTERSECTIONS_SCALAR_PROBE forces the byte-at-a-time version.
+class probe_group
+{
+public:
+#if defined(INTERSECTIONS_PROBE_AVX2)
+    static constexpr size_t width = 32;
+
+    explicit probe_group(const ctrl_t* ctrl)
+            : ctrl_(_mm256_loadu_si256(
+                      reinterpret_cast<const __m256i*>(ctrl)))
+    { }
+
+    group_mask match(ctrl_t fragment) const
+    {
+        auto eq = _mm256_cmpeq_epi8(ctrl_, _mm256_set1_epi8(fragment));
+        return group_mask(std::uint32_t(_mm256_movemask_epi8(eq)));
+    }
+
+    group_mask match_empty() const
+    {
+        return match(ctrl_empty);
+    }
+
+    group_mask match_full() const
+    {
+        return group_mask(~std::uint32_t(_mm256_movemask_epi8(ctrl_)));
+    }
+
+private:
+    __m256i ctrl_;
+#elif defined(INTERSECTIONS_PROBE_SSE2)
+    static constexpr size_t width = 16;
+
+    explicit probe_group(const ctrl_t* ctrl)
+            : ctrl_(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl)))
+    { }
+
+    group_mask match(ctrl_t fragment) const
+    {
+        auto eq = _mm_cmpeq_epi8(ctrl_, _mm_set1_epi8(fragment));
+        return group_mask(std::uint32_t(_mm_movemask_epi8(eq)));
+    }
+
+    group_mask match_empty() const
+    {
+        return match(ctrl_empty);
+    }
+
+    group_mask match_full() const
+    {
+        return group_mask(~std::uint32_t(_mm_movemask_epi8(ctrl_)) & 0xFFFF);
+    }
+
+private:
+    __m128i ctrl_;
+#else
+    static constexpr size_t width = 16;
+
+    explicit probe_group(const ctrl_t* ctrl) : ctrl_(ctrl) { }
+
+    group_mask match(ctrl_t fragment) const
+    {
+        std::uint32_t bits = 0;
+        for (size_t i = 0; i < width; ++i) {
+            if (ctrl_[i] == fragment) bits |= std::uint32_t(1) << i;
+        }
+
+        return group_mask(bits);
+    }
+
+    group_mask match_empty() const
+    {
+        return match(ctrl_empty);
+    }
+
+    group_mask match_full() const
+    {
+        std::uint32_t bits = 0;
+        for (size_t i = 0; i < width; ++i) {
+            if (ctrl_[i] >= 0) bits |= std::uint32_t(1) << i;
+        }
+
+        return group_mask(bits);
+    }
+
+private:
+    const ctrl_t* ctrl_;
+#endif
+};
+
+} // end namespace intersections::util
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "rh_unordered_set.h"
+#include "weak_unordered_set.h"
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace intersections::util {
+
+/// Revisions count changes to the inputs of a query_database.
+using revision_t = size_t;
+
+class query_database;
+
+/// Something a query can read: an input cell or another query's result.
+struct query_dependency
+{
+    /// Brings this dependency up to date with the database, returning the
+    /// revision at which its value last changed.
+    virtual revision_t refresh(query_database&) = 0;
+    virtual ~query_dependency() = default;
+};
+
+using dependency_list = std::vector<std::shared_ptr<query_dependency>>;
+
+/// Tracks the current revision and which queries are being computed, so
+/// that every read can be recorded as a dependency of the query doing the
+/// reading.
+class query_database
+{
+public:
+    revision_t revision() const
+    {
+        return revision_;
+    }
+
+    /// Records a read of `dependency` by the query being computed, if any.
+    void record(std::shared_ptr<query_dependency> dependency)
+    {
+        if (!frames_.empty())
+            frames_.back()->push_back(std::move(dependency));
+    }
+
+    /// Starts a new revision, returning it.
+    revision_t bump()
+    {
+        return ++revision_;
+    }
+
+    /// Runs `compute` with its reads recorded into `dependencies`.
+    template <class F>
+    auto tracking(dependency_list& dependencies, F compute)
+    {
+        struct frame_guard {
+            std::vector<dependency_list*>& frames;
+            ~frame_guard() { frames.pop_back(); }
+        };
+
+        frames_.push_back(&dependencies);
+        frame_guard guard{frames_};
+        return compute();
+    }
+
+private:
+    revision_t revision_ = 1;
+    std::vector<dependency_list*> frames_;
+};
+
+/// A table of input values, set from outside. Setting an input to a new
+/// value starts a new revision; setting it to an equal value does not.
+template <class Key, class Value,
+          class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>>
+class input_query
+{
+public:
+    explicit input_query(query_database& db) : db_(db) { }
+
+    void set(const Key& key, Value value)
+    {
+        auto& cell = cells_[key];
+
+        if (!cell) {
+            cell = std::make_shared<cell_t>(std::move(value), db_.bump());
+        } else if (!(cell->value == value)) {
+            cell->value = std::move(value);
+            cell->changed_at = db_.bump();
+        }
+    }
+
+    /// Reads an input, recording the dependency.
+    /// Throws std::out_of_range if the input was never set.
+    const Value& get(const Key& key)
+    {
+        auto iter = cells_.find(key);
+        if (iter == cells_.end())
+            throw std::out_of_range("input_query::get");
+
+        auto& cell = (*iter).second;
+        db_.record(cell);
+        return cell->value;
+    }
+
+private:
+    struct cell_t : query_dependency
+    {
+        cell_t(Value value, revision_t changed_at)
+                : value(std::move(value)), changed_at(changed_at)
+        { }
+
+        revision_t refresh(query_database&) override
+        {
+            return changed_at;
+        }
+
+        Value value;
+        revision_t changed_at;
+    };
+
+    query_database& db_;
+    rh_unordered_map<Key, std::shared_ptr<cell_t>, Hash, KeyEqual> cells_;
+};
+
+/// A derived fact about shared keys, such as the normal form of a type.
+///
+/// Each result remembers the inputs and queries it read. After inputs
+/// change, a result is recomputed only if something it read has changed,
+/// and a recomputed result equal to the old one doesn't count as a change
+/// to the queries that read it. Results are held in a
+/// weak_key_unordered_map, so they are collected along with their keys.
+///
+/// The compute function may read other queries, but not (transitively)
+/// itself.
+template <class Key, class Value,
+          class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>>
+class derived_query
+{
+public:
+    using key_pointer = std::shared_ptr<const Key>;
+    using function_type = std::function<Value(const key_pointer&)>;
+
+    derived_query(query_database& db, function_type compute)
+            : db_(db), compute_(std::move(compute))
+    { }
+
+    /// Reads the result for `key`, recording the dependency and bringing
+    /// the result up to date first.
+    const Value& get(const key_pointer& key)
+    {
+        std::shared_ptr<node_t> node;
+
+        auto iter = nodes_.find(*key);
+        if (iter != nodes_.end()) {
+            node = (*iter).second;
+        } else {
+            node = std::make_shared<node_t>(*this, key);
+            nodes_.insert({key, node});
+        }
+
+        node->refresh(db_);
+        db_.record(node);
+        return *node->value;
+    }
+
+    /// How many times the compute function has run.
+    size_t computations() const
+    {
+        return computations_;
+    }
+
+private:
+    struct node_t : query_dependency
+    {
+        node_t(derived_query& owner, const key_pointer& key)
+                : owner(owner), key(key)
+        { }
+
+        revision_t refresh(query_database& db) override
+        {
+            if (value && verified_at == db.revision())
+                return changed_at;
+
+            if (computing)
+                throw std::logic_error("derived_query: cycle");
+
+            if (value && !dependencies_changed_(db)) {
+                verified_at = db.revision();
+                return changed_at;
+            }
+
+            auto strong_key = key.lock();
+            if (!strong_key) {
+                // Nobody can ask about this key any more, so any
+                // dependents will be recomputed from scratch anyway.
+                verified_at = changed_at = db.revision();
+                return changed_at;
+            }
+
+            dependency_list new_dependencies;
+            computing = true;
+            try {
+                Value new_value = db.tracking(new_dependencies, [&] {
+                    return owner.compute_(strong_key);
+                });
+                computing = false;
+                ++owner.computations_;
+
+                if (!value || !(*value == new_value)) {
+                    value = std::move(new_value);
+                    changed_at = db.revision();
+                }
+            } catch (...) {
+                computing = false;
+                throw;
+            }
+
+            dependencies = std::move(new_dependencies);
+            verified_at = db.revision();
+            return changed_at;
+        }
+
+        derived_query& owner;
+        std::weak_ptr<const Key> key;
+        std::optional<Value> value;
+        dependency_list dependencies;
+        revision_t verified_at = 0;
+        revision_t changed_at = 0;
+        bool computing = false;
+
+    private:
+        bool dependencies_changed_(query_database& db)
+        {
+            for (const auto& dependency : dependencies) {
+                if (dependency->refresh(db) > verified_at)
+                    return true;
+            }
+
+            return false;
+        }
+    };
+
+    query_database& db_;
+    function_type compute_;
+    weak_key_unordered_map<Key, std::shared_ptr<node_t>, Hash, KeyEqual>
+        nodes_;
+    size_t computations_ = 0;
+};
+
+} // end namespace intersections::util
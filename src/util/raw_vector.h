@@ -40,6 +40,7 @@ public:
     {
         swap(other);
         other.clear();
+        return *this;
     }
 
     raw_vector(const raw_vector&) = delete;
@@ -67,6 +68,7 @@ public:
     {
         if (size_ != 0) {
             deallocate_();
+            size_ = 0;
             data_ = allocate_(allocator_, 0);
         }
     }
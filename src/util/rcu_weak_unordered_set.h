@@ -0,0 +1,358 @@
+#pragma once
+
+#include "epoch.h"
+#include "weak_unordered_set.h"
+
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace intersections::util {
+
+/// A weak set whose lookups take no locks, for tables that many threads
+/// read and few write. Readers probe an array of buckets that is never
+/// changed in place once a bucket is filled: writers, one at a time,
+/// fill empty buckets, mark erased ones deleted, and once the array is
+/// full, publish a new one holding just the live elements. Old arrays
+/// are freed through epoch_domain once no reader can be looking at them.
+///
+/// Since filled buckets never move, this uses linear probing rather than
+/// Robin Hood, and expired and erased elements keep their buckets until
+/// the next new array.
+template <
+    class Key,
+    class Hash = std::hash<Key>,
+    class KeyEqual = std::equal_to<Key>
+>
+class rcu_weak_unordered_set
+{
+public:
+    using key_type          = Key;
+    using strong_value_type = std::shared_ptr<const Key>;
+    using hasher            = Hash;
+    using key_equal         = KeyEqual;
+
+    /// Constructs a new, empty set with room for `count` elements.
+    explicit rcu_weak_unordered_set(
+            size_t count = 0,
+            const hasher& hash = hasher(),
+            const key_equal& equal = key_equal())
+        : hash_(hash)
+        , equal_(equal)
+        , table_(new table(buckets_needed_(count)))
+    { }
+
+    rcu_weak_unordered_set(const rcu_weak_unordered_set&) = delete;
+    rcu_weak_unordered_set& operator=(const rcu_weak_unordered_set&)
+            = delete;
+
+    /// No other thread may be using the set.
+    ~rcu_weak_unordered_set()
+    {
+        delete table_.load();
+    }
+
+    /// The number of elements inserted and not erased or removed, which
+    /// includes those that have expired since the last new array.
+    size_t size() const
+    {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t bucket_count() const
+    {
+        epoch_guard guard;
+        return table_.load(std::memory_order_acquire)->bucket_count();
+    }
+
+    /// Returns the element equal to `key`, or null. Takes no locks.
+    template <class K>
+    strong_value_type find(const K& key) const
+    {
+        return find(key, hash_(key));
+    }
+
+    template <class K>
+    strong_value_type find(const K& key, size_t hash_code) const
+    {
+        epoch_guard guard;
+        return table_.load(std::memory_order_acquire)
+                   ->find(key, hash_code, fragment_(hash_code), equal_);
+    }
+
+    template <class K>
+    bool member(const K& key) const
+    {
+        return find(key) != nullptr;
+    }
+
+    template <class K>
+    bool member(const K& key, size_t hash_code) const
+    {
+        return find(key, hash_code) != nullptr;
+    }
+
+    template <class K>
+    size_t count(const K& key) const
+    {
+        return member(key)? 1 : 0;
+    }
+
+    /// Inserts an element, unless there's already one equal to it.
+    void insert(const strong_value_type& value)
+    {
+        find_or_insert(*value, [&] { return value; });
+    }
+
+    /// Returns the element with the given key, if there is one. Otherwise
+    /// inserts and returns `factory()`, whose key must equal `key`. Only
+    /// insertion takes the writers' lock. The factory must not use this
+    /// set.
+    template <class K, class F>
+    strong_value_type find_or_insert(const K& key, F&& factory)
+    {
+        return find_or_insert(key, hash_(key), std::forward<F>(factory));
+    }
+
+    template <class K, class F>
+    strong_value_type find_or_insert(const K& key, size_t hash_code,
+                                     F&& factory)
+    {
+        if (auto found = find(key, hash_code)) return found;
+
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        ctrl_t fragment = fragment_(hash_code);
+
+        // Another writer may have inserted it since we looked.
+        table* t = table_.load(std::memory_order_relaxed);
+        if (auto found = t->find(key, hash_code, fragment, equal_))
+            return found;
+
+        strong_value_type value = factory();
+        assert(hash_(*value) == hash_code);
+
+        if (t->used + 1 > t->bucket_count() * grow_at_ratio) {
+            t = rebuild_(buckets_needed_(2 * (t->count_live() + 1)));
+        }
+
+        t->place(value, hash_code, fragment);
+        size_.fetch_add(1, std::memory_order_relaxed);
+        return value;
+    }
+
+    /// Returns the element equal to `Key(args...)`, inserting a new one
+    /// if there is none.
+    template <class... Args>
+    strong_value_type try_emplace(Args&&... args)
+    {
+        Key key(std::forward<Args>(args)...);
+        return find_or_insert(key, [&] {
+            return std::make_shared<const Key>(std::move(key));
+        });
+    }
+
+    /// Erases the element with the given key, returning whether there
+    /// was one. Its bucket stays taken until the next new array.
+    bool erase(const key_type& key)
+    {
+        size_t hash_code = hash_(key);
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+
+        if (table_.load(std::memory_order_relaxed)
+                  ->erase(key, hash_code, fragment_(hash_code), equal_)) {
+            size_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        return false;
+    }
+
+    /// Publishes a new array holding just the live elements, sized to
+    /// let them double before it fills. After this, `size()` is accurate
+    /// (for the moment).
+    void remove_expired()
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        table* t = table_.load(std::memory_order_relaxed);
+        rebuild_(buckets_needed_(2 * t->count_live()));
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        publish_(new table(buckets_needed_(0)));
+        size_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    class table
+    {
+    public:
+        explicit table(size_t bucket_count)
+                : mask_(bucket_count - 1)
+                , ctrl_(new std::atomic<ctrl_t>[bucket_count])
+                , buckets_(new bucket[bucket_count])
+        {
+            for (size_t pos = 0; pos < bucket_count; ++pos)
+                ctrl_[pos].store(ctrl_empty, std::memory_order_relaxed);
+        }
+
+        size_t bucket_count() const
+        {
+            return mask_ + 1;
+        }
+
+        // Readers may call this while a writer is filling buckets or
+        // marking them deleted. A bucket's contents are written before
+        // its control byte, which is the only part ever changed after.
+        template <class K>
+        strong_value_type find(const K& key, size_t hash_code,
+                               ctrl_t fragment, const KeyEqual& equal) const
+        {
+            strong_value_type found;
+            find_pos_(key, hash_code, fragment, equal, found);
+            return found;
+        }
+
+        template <class K>
+        bool erase(const K& key, size_t hash_code,
+                   ctrl_t fragment, const KeyEqual& equal)
+        {
+            strong_value_type found;
+            size_t pos = find_pos_(key, hash_code, fragment, equal, found);
+            if (pos == npos_) return false;
+
+            ctrl_[pos].store(ctrl_deleted, std::memory_order_release);
+            return true;
+        }
+
+        // Writers only. The key must not be present already.
+        void place(const strong_value_type& value, size_t hash_code,
+                   ctrl_t fragment)
+        {
+            size_t pos = hash_code & mask_;
+            while (ctrl_[pos].load(std::memory_order_relaxed) != ctrl_empty)
+                pos = (pos + 1) & mask_;
+
+            buckets_[pos].hash_code = hash_code;
+            buckets_[pos].value = value;
+            ctrl_[pos].store(fragment, std::memory_order_release);
+            ++used;
+        }
+
+        // Writers only.
+        size_t count_live() const
+        {
+            size_t result = 0;
+            for (size_t pos = 0; pos <= mask_; ++pos) {
+                if (ctrl_[pos].load(std::memory_order_relaxed) >= 0 &&
+                    !buckets_[pos].value.expired())
+                    ++result;
+            }
+
+            return result;
+        }
+
+        // Writers only. Copies the live elements into `other`, returning
+        // how many.
+        size_t copy_live_to(table& other) const
+        {
+            size_t result = 0;
+            for (size_t pos = 0; pos <= mask_; ++pos) {
+                ctrl_t ctrl = ctrl_[pos].load(std::memory_order_relaxed);
+                if (ctrl < 0) continue;
+
+                if (auto value = buckets_[pos].value.lock()) {
+                    other.place(value, buckets_[pos].hash_code, ctrl);
+                    ++result;
+                }
+            }
+
+            return result;
+        }
+
+        // The number of buckets ever filled. Writers only.
+        size_t used = 0;
+
+    private:
+        struct bucket
+        {
+            size_t hash_code = 0;
+            std::weak_ptr<const Key> value;
+        };
+
+        size_t mask_;
+        std::unique_ptr<std::atomic<ctrl_t>[]> ctrl_;
+        std::unique_ptr<bucket[]> buckets_;
+
+        // Returns the position of the live element equal to `key`, and
+        // the element in `found`, or npos_.
+        template <class K>
+        size_t find_pos_(const K& key, size_t hash_code,
+                         ctrl_t fragment, const KeyEqual& equal,
+                         strong_value_type& found) const
+        {
+            for (size_t pos = hash_code & mask_; ; pos = (pos + 1) & mask_) {
+                ctrl_t ctrl = ctrl_[pos].load(std::memory_order_acquire);
+                if (ctrl == ctrl_empty) return npos_;
+                if (ctrl != fragment || buckets_[pos].hash_code != hash_code)
+                    continue;
+
+                found = buckets_[pos].value.lock();
+                if (found && equal(*found, key)) return pos;
+                found = nullptr;
+            }
+        }
+    };
+
+    static constexpr size_t npos_ = size_t(-1);
+
+    Hash hash_;
+    KeyEqual equal_;
+    std::atomic<table*> table_;
+    std::atomic<size_t> size_{0};
+    std::mutex writer_mutex_;
+
+    // Writers only. Replaces the array with a new one of the given size
+    // holding the live elements.
+    table* rebuild_(size_t bucket_count)
+    {
+        table* old = table_.load(std::memory_order_relaxed);
+        auto fresh = new table(bucket_count);
+        size_.store(old->copy_live_to(*fresh), std::memory_order_relaxed);
+        publish_(fresh);
+        return fresh;
+    }
+
+    // Writers only. Makes `fresh` the array that readers see, and retires
+    // the old one.
+    void publish_(table* fresh)
+    {
+        table* old = table_.exchange(fresh, std::memory_order_acq_rel);
+        epoch_domain::global().retire([old] { delete old; });
+    }
+
+    // A power of two with room for `count` elements below grow_at_ratio.
+    static size_t buckets_needed_(size_t count)
+    {
+        size_t result = default_bucket_count;
+        while (count >= result * grow_at_ratio) result *= 2;
+        return result;
+    }
+
+    // As in rh_weak_hash_table, the high bits of a multiplicative hash.
+    static ctrl_t fragment_(size_t hash_code)
+    {
+        return ctrl_t((hash_code * size_t(0x9E3779B97F4A7C15))
+                      >> (sizeof(size_t) * CHAR_BIT - 7));
+    }
+};
+
+} // end namespace intersections::util
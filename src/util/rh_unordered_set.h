@@ -0,0 +1,175 @@
+#pragma once
+
+#include "weak_unordered_set.h"
+
+#include <utility>
+
+namespace intersections::util {
+
+// The Robin Hood engine of rh_weak_hash_table, holding its elements
+// strongly: flat, open-addressed replacements for std::unordered_set and
+// std::unordered_map, with no node per element. The tables store the
+// elements in their buckets, through these never-expiring "weak" values.
+
+/// A set element that never expires. Views are references into the
+/// bucket, so looking at an element copies nothing.
+template <class T>
+struct strong_element
+{
+    using key_type = T;
+    using strong_type = T;
+    using view_type = const T&;
+    using const_view_type = const T&;
+
+    static constexpr bool never_expires = true;
+
+    T value;
+
+    strong_element(const T& strong)
+            : value(strong)
+    { }
+
+    strong_element(T&& strong)
+            : value(std::move(strong))
+    { }
+
+    bool expired() const
+    {
+        return false;
+    }
+
+    const T& lock() const
+    {
+        return value;
+    }
+
+    static const key_type* key(const T& view)
+    {
+        return &view;
+    }
+
+    static const key_type* peek_key(const strong_element& element)
+    {
+        return &element.value;
+    }
+};
+
+/// A map entry that never expires. Views are pairs of references into
+/// the bucket, through which the value may be modified.
+template <class Key, class Value>
+struct strong_pair
+{
+    using key_type = Key;
+    using value_type = Value;
+    using strong_type = std::pair<Key, Value>;
+    using view_type = std::pair<const Key&, Value&>;
+    using const_view_type = std::pair<const Key&, const Value&>;
+
+    static constexpr bool never_expires = true;
+
+    Key first;
+    Value second;
+
+    strong_pair(const strong_type& strong)
+            : first(strong.first), second(strong.second)
+    { }
+
+    strong_pair(strong_type&& strong)
+            : first(std::move(strong.first)), second(std::move(strong.second))
+    { }
+
+    bool expired() const
+    {
+        return false;
+    }
+
+    view_type lock()
+    {
+        return {first, second};
+    }
+
+    const_view_type lock() const
+    {
+        return {first, second};
+    }
+
+    template <class View>
+    static const key_type* key(const View& view)
+    {
+        return &view.first;
+    }
+
+    static const key_type* peek_key(const strong_pair& entry)
+    {
+        return &entry.first;
+    }
+};
+
+template <
+    class Key,
+    class Hash = std::hash<Key>,
+    class KeyEqual = std::equal_to<Key>,
+    class Allocator = std::allocator<Key>,
+    class SizePolicy = power_of_two_sizing
+>
+class rh_unordered_set
+    : public rh_weak_hash_table<strong_element<Key>,
+                                Hash, KeyEqual, Allocator, SizePolicy>
+{
+    using BaseClass = rh_weak_hash_table<strong_element<Key>,
+                                         Hash, KeyEqual, Allocator,
+                                         SizePolicy>;
+public:
+    using BaseClass::rh_weak_hash_table;
+};
+
+template <class Key, class Hash, class KeyEqual, class Allocator,
+          class SizePolicy>
+void swap(rh_unordered_set<Key, Hash, KeyEqual, Allocator, SizePolicy>& a,
+          rh_unordered_set<Key, Hash, KeyEqual, Allocator, SizePolicy>& b)
+{
+    a.swap(b);
+}
+
+template <
+    class Key,
+    class Value,
+    class Hash = std::hash<Key>,
+    class KeyEqual = std::equal_to<Key>,
+    class Allocator = std::allocator<std::pair<const Key, Value>>,
+    class SizePolicy = power_of_two_sizing
+>
+class rh_unordered_map
+    : public rh_weak_hash_table<strong_pair<Key, Value>,
+                                Hash, KeyEqual, Allocator, SizePolicy>
+{
+    using BaseClass = rh_weak_hash_table<strong_pair<Key, Value>,
+                                         Hash, KeyEqual, Allocator,
+                                         SizePolicy>;
+public:
+    using BaseClass::rh_weak_hash_table;
+
+    /// The value for `key`, inserting a default-constructed one if there
+    /// is none, in a single probe. Like all references into the table,
+    /// it's good only until the next insertion or erasure.
+    Value& operator[](const Key& key)
+    {
+        return this->find_or_insert_in_place_(key, [&] {
+            return std::pair<Key, Value>(key, Value());
+        }).second;
+    }
+
+    /// Inserts an entry. Unlike std::unordered_map::insert, if the key is
+    /// already present, this replaces its value.
+    using BaseClass::insert;
+};
+
+template <class Key, class Value, class Hash, class KeyEqual, class Allocator,
+          class SizePolicy>
+void swap(rh_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& a,
+          rh_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& b)
+{
+    a.swap(b);
+}
+
+} // end namespace intersections::util
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace intersections::util {
+
+// A sizing policy decides which bucket counts a hash table may have, and
+// maps hash codes to buckets. Every policy provides:
+//
+//  - round_up(n): the smallest allowed bucket count that is at least n
+//    (0 stays 0)
+//  - reset(n): prepares for a bucket count of n, as returned by round_up
+//  - home(h): the preferred bucket of hash code h
+//  - wrap(pos): the bucket at position pos, for pos < n + 32, counting
+//    past the end of the table as wrapping around to the start
+//  - distance(actual, preferred): how far past its preferred bucket an
+//    element in bucket actual is
+
+/// Powers of two, choosing buckets by masking off the low bits of the
+/// hash code. The fastest, but the hasher must vary the low bits.
+class power_of_two_sizing
+{
+public:
+    static size_t round_up(size_t n)
+    {
+        if (n == 0) return 0;
+
+        size_t result = 1;
+        while (result < n) result <<= 1;
+        return result;
+    }
+
+    void reset(size_t bucket_count)
+    {
+        mask_ = bucket_count == 0 ? 0 : bucket_count - 1;
+    }
+
+    size_t home(size_t hash_code) const
+    {
+        return hash_code & mask_;
+    }
+
+    size_t wrap(size_t pos) const
+    {
+        return pos & mask_;
+    }
+
+    size_t distance(size_t actual, size_t preferred) const
+    {
+        return (actual - preferred) & mask_;
+    }
+
+private:
+    size_t mask_ = 0;
+};
+
+/// Any bucket count, choosing buckets by Lemire's fastrange: the high
+/// half of the product of the hash code and the bucket count. There's no
+/// division, but the hasher must vary the high bits.
+class fastrange_sizing
+{
+public:
+    static size_t round_up(size_t n)
+    {
+        return n;
+    }
+
+    void reset(size_t bucket_count)
+    {
+        bucket_count_ = bucket_count;
+    }
+
+    size_t home(size_t hash_code) const
+    {
+        using wide_t = unsigned __int128;
+        return size_t((wide_t(hash_code) * wide_t(bucket_count_))
+                      >> (sizeof(size_t) * 8));
+    }
+
+    size_t wrap(size_t pos) const
+    {
+        while (pos >= bucket_count_) pos -= bucket_count_;
+        return pos;
+    }
+
+    size_t distance(size_t actual, size_t preferred) const
+    {
+        if (actual >= preferred)
+            return actual - preferred;
+        else
+            return actual + bucket_count_ - preferred;
+    }
+
+private:
+    size_t bucket_count_ = 0;
+};
+
+/// Prime bucket counts, roughly doubling, choosing buckets by the
+/// remainder. A division per lookup, but every bit of the hash code
+/// matters, so it tolerates weak hashers such as the identity on
+/// pointers.
+class prime_sizing
+{
+public:
+    static size_t round_up(size_t n)
+    {
+        if (n == 0) return 0;
+
+        for (size_t prime : primes_) {
+            if (prime >= n) return prime;
+        }
+
+        return primes_[sizeof primes_ / sizeof primes_[0] - 1];
+    }
+
+    void reset(size_t bucket_count)
+    {
+        bucket_count_ = bucket_count;
+    }
+
+    size_t home(size_t hash_code) const
+    {
+        return hash_code % bucket_count_;
+    }
+
+    size_t wrap(size_t pos) const
+    {
+        while (pos >= bucket_count_) pos -= bucket_count_;
+        return pos;
+    }
+
+    size_t distance(size_t actual, size_t preferred) const
+    {
+        if (actual >= preferred)
+            return actual - preferred;
+        else
+            return actual + bucket_count_ - preferred;
+    }
+
+private:
+    size_t bucket_count_ = 0;
+
+    // The least prime greater than each power of two from 8 to 2^63.
+    static constexpr std::uint64_t primes_[] = {
+        11ull, 17ull, 37ull, 67ull, 131ull, 257ull, 521ull, 1031ull, 2053ull,
+        4099ull, 8209ull, 16411ull, 32771ull, 65537ull, 131101ull, 262147ull,
+        524309ull, 1048583ull, 2097169ull, 4194319ull, 8388617ull,
+        16777259ull, 33554467ull, 67108879ull, 134217757ull, 268435459ull,
+        536870923ull, 1073741827ull, 2147483659ull, 4294967311ull,
+        8589934609ull, 17179869209ull, 34359738421ull, 68719476767ull,
+        137438953481ull, 274877906951ull, 549755813911ull, 1099511627791ull,
+        2199023255579ull, 4398046511119ull, 8796093022237ull,
+        17592186044423ull, 35184372088891ull, 70368744177679ull,
+        140737488355333ull, 281474976710677ull, 562949953421381ull,
+        1125899906842679ull, 2251799813685269ull, 4503599627370517ull,
+        9007199254740997ull, 18014398509482143ull, 36028797018963971ull,
+        72057594037928017ull, 144115188075855881ull, 288230376151711813ull,
+        576460752303423619ull, 1152921504606847009ull,
+        2305843009213693967ull, 4611686018427388039ull,
+        9223372036854775837ull
+    };
+};
+
+} // end namespace intersections::util
@@ -0,0 +1,503 @@
+#pragma once
+
+#include "weak_unordered_set.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace intersections::util {
+
+// Weak handles other than std::weak_ptr, each with its weak_traits, so
+// that rh_weak_hash_table can hold them:
+//
+//  - intrusive_weak_ptr points to an object allocated together with its
+//    strong and weak counts, with no separate control block, so it
+//    takes one word rather than two.
+//
+//  - arena_handle names a slot of a slot_arena by index and generation,
+//    and expires when the slot is destroyed, which bumps its generation.
+
+template <class T>
+class intrusive_ptr;
+
+template <class T>
+class intrusive_weak_ptr;
+
+namespace detail {
+
+// An object with its reference counts. The strong references together
+// hold one weak reference, so the memory outlives the object until the
+// last weak reference goes.
+template <class T>
+struct intrusive_box
+{
+    std::atomic<uint32_t> strong{1};
+    std::atomic<uint32_t> weak{1};
+    alignas(T) unsigned char storage[sizeof(T)];
+
+    T* object()
+    {
+        return std::launder(reinterpret_cast<T*>(storage));
+    }
+
+    void release_strong()
+    {
+        if (strong.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            object()->~T();
+            release_weak();
+        }
+    }
+
+    void release_weak()
+    {
+        if (weak.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+};
+
+} // end namespace detail
+
+/// Makes an object that intrusive_ptrs and intrusive_weak_ptrs can refer
+/// to, in a single allocation.
+template <class T, class... Args>
+intrusive_ptr<T> make_intrusive(Args&&... args);
+
+/// A strong reference to an object made by make_intrusive.
+template <class T>
+class intrusive_ptr
+{
+public:
+    using element_type = T;
+
+    intrusive_ptr() = default;
+
+    intrusive_ptr(std::nullptr_t) { }
+
+    intrusive_ptr(const intrusive_ptr& other)
+            : box_(other.box_)
+    {
+        if (box_) box_->strong.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    intrusive_ptr(intrusive_ptr&& other) noexcept
+            : box_(std::exchange(other.box_, nullptr))
+    { }
+
+    intrusive_ptr& operator=(intrusive_ptr other) noexcept
+    {
+        std::swap(box_, other.box_);
+        return *this;
+    }
+
+    ~intrusive_ptr()
+    {
+        if (box_) box_->release_strong();
+    }
+
+    T* get() const
+    {
+        return box_ ? box_->object() : nullptr;
+    }
+
+    T& operator*() const
+    {
+        return *get();
+    }
+
+    T* operator->() const
+    {
+        return get();
+    }
+
+    explicit operator bool() const
+    {
+        return box_ != nullptr;
+    }
+
+    friend bool operator==(const intrusive_ptr& a, const intrusive_ptr& b)
+    {
+        return a.box_ == b.box_;
+    }
+
+    friend bool operator!=(const intrusive_ptr& a, const intrusive_ptr& b)
+    {
+        return a.box_ != b.box_;
+    }
+
+private:
+    using box_t = detail::intrusive_box<std::remove_cv_t<T>>;
+
+    box_t* box_ = nullptr;
+
+    // Takes over a strong reference that's already been counted.
+    explicit intrusive_ptr(box_t* box) : box_(box) { }
+
+    friend class intrusive_weak_ptr<T>;
+
+    template <class U, class... Args>
+    friend intrusive_ptr<U> make_intrusive(Args&&...);
+};
+
+/// A weak reference to an object made by make_intrusive: one pointer,
+/// to memory that stays allocated, holding just the counts, until no
+/// weak references remain.
+template <class T>
+class intrusive_weak_ptr
+{
+public:
+    intrusive_weak_ptr() = default;
+
+    intrusive_weak_ptr(const intrusive_ptr<T>& strong)
+            : box_(strong.box_)
+    {
+        if (box_) box_->weak.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    intrusive_weak_ptr(const intrusive_weak_ptr& other)
+            : box_(other.box_)
+    {
+        if (box_) box_->weak.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    intrusive_weak_ptr(intrusive_weak_ptr&& other) noexcept
+            : box_(std::exchange(other.box_, nullptr))
+    { }
+
+    intrusive_weak_ptr& operator=(intrusive_weak_ptr other) noexcept
+    {
+        std::swap(box_, other.box_);
+        return *this;
+    }
+
+    ~intrusive_weak_ptr()
+    {
+        if (box_) box_->release_weak();
+    }
+
+    bool expired() const
+    {
+        return !box_ || box_->strong.load(std::memory_order_acquire) == 0;
+    }
+
+    /// A strong reference, or null if the object has died. Never revives
+    /// an object whose count has reached zero.
+    intrusive_ptr<T> lock() const
+    {
+        if (!box_) return nullptr;
+
+        uint32_t count = box_->strong.load(std::memory_order_relaxed);
+        while (count != 0) {
+            if (box_->strong.compare_exchange_weak(
+                        count, count + 1, std::memory_order_acq_rel,
+                        std::memory_order_relaxed))
+                return intrusive_ptr<T>(box_);
+        }
+
+        return nullptr;
+    }
+
+private:
+    typename intrusive_ptr<T>::box_t* box_ = nullptr;
+};
+
+template <class T, class... Args>
+intrusive_ptr<T> make_intrusive(Args&&... args)
+{
+    using box_t = typename intrusive_ptr<T>::box_t;
+
+    auto box = new box_t;
+    try {
+        ::new (static_cast<void*>(box->storage))
+                std::remove_cv_t<T>(std::forward<Args>(args)...);
+    } catch (...) {
+        delete box;
+        throw;
+    }
+
+    return intrusive_ptr<T>(box);
+}
+
+template <class T>
+struct weak_traits<intrusive_weak_ptr<T>>
+{
+    using strong_type = intrusive_ptr<T>;
+    using view_type = strong_type;
+    using const_view_type = view_type;
+    using key_type = T;
+
+    static key_type* key(const view_type& view)
+    {
+        return view.get();
+    }
+
+    static strong_type move(view_type& view)
+    {
+        return std::move(view);
+    }
+};
+
+template <class T, class Tag>
+class slot_arena;
+
+/// A reference to a live object in a slot_arena, as returned by making
+/// the object or locking an arena_handle. It doesn't keep the object
+/// alive: it's only good until the slot is destroyed.
+template <class T, class Tag = void>
+class arena_ref
+{
+public:
+    arena_ref() = default;
+
+    arena_ref(std::nullptr_t) { }
+
+    T* get() const
+    {
+        return object_;
+    }
+
+    T& operator*() const
+    {
+        return *object_;
+    }
+
+    T* operator->() const
+    {
+        return object_;
+    }
+
+    explicit operator bool() const
+    {
+        return object_ != nullptr;
+    }
+
+    uint32_t index() const
+    {
+        return index_;
+    }
+
+    uint32_t generation() const
+    {
+        return generation_;
+    }
+
+    // A reused slot holds a different object, under a new generation.
+    friend bool operator==(const arena_ref& a, const arena_ref& b)
+    {
+        return a.object_ == b.object_ && a.generation_ == b.generation_;
+    }
+
+    friend bool operator!=(const arena_ref& a, const arena_ref& b)
+    {
+        return !(a == b);
+    }
+
+private:
+    T* object_ = nullptr;
+    uint32_t index_ = 0;
+    uint32_t generation_ = 0;
+
+    arena_ref(T* object, uint32_t index, uint32_t generation)
+            : object_(object), index_(index), generation_(generation)
+    { }
+
+    friend class slot_arena<std::remove_cv_t<T>, Tag>;
+};
+
+/// A weak reference to a slot of `slot_arena<T, Tag>::instance()`: an
+/// index and the generation of the slot when the object was made, so 8
+/// bytes with no allocation of its own. It expires when the slot is
+/// destroyed. Generation 0 is never used, so a default handle is always
+/// expired.
+template <class T, class Tag = void>
+class arena_handle
+{
+public:
+    using arena_type = slot_arena<std::remove_cv_t<T>, Tag>;
+
+    arena_handle() = default;
+
+    arena_handle(const arena_ref<T, Tag>& ref)
+            : index_(ref.index()), generation_(ref.generation())
+    { }
+
+    bool expired() const
+    {
+        return !arena_type::instance().contains(index_, generation_);
+    }
+
+    arena_ref<T, Tag> lock() const
+    {
+        return arena_type::instance().template find<T>(index_, generation_);
+    }
+
+    uint32_t index() const
+    {
+        return index_;
+    }
+
+    uint32_t generation() const
+    {
+        return generation_;
+    }
+
+private:
+    uint32_t index_ = 0;
+    uint32_t generation_ = 0;
+};
+
+/// Objects of type T in slots that are reused once destroyed. Each Tag
+/// names a separate arena, of which there's one, instance(), so that
+/// handles don't need to point to it. Slots don't move, so references
+/// stay good until their slot is destroyed. Not thread-safe.
+template <class T, class Tag = void>
+class slot_arena
+{
+public:
+    using handle = arena_handle<const T, Tag>;
+    using ref = arena_ref<const T, Tag>;
+
+    static slot_arena& instance()
+    {
+        static slot_arena arena;
+        return arena;
+    }
+
+    slot_arena(const slot_arena&) = delete;
+    slot_arena& operator=(const slot_arena&) = delete;
+
+    ~slot_arena()
+    {
+        for (auto& each : slots_) {
+            if (each.live) each.object()->~T();
+        }
+    }
+
+    /// Makes an object in a free slot.
+    template <class... Args>
+    ref make(Args&&... args)
+    {
+        uint32_t index;
+        if (free_.empty()) {
+            assert(slots_.size() < std::numeric_limits<uint32_t>::max());
+            index = uint32_t(slots_.size());
+            slots_.emplace_back();
+        } else {
+            index = free_.back();
+            free_.pop_back();
+        }
+
+        slot& s = slots_[index];
+        ::new (static_cast<void*>(s.storage)) T(std::forward<Args>(args)...);
+        s.live = true;
+        ++size_;
+        return ref(s.object(), index, s.generation);
+    }
+
+    /// Destroys the object, expiring every handle to it. Returns whether
+    /// the handle was live.
+    bool destroy(const handle& h)
+    {
+        if (!contains(h.index(), h.generation())) return false;
+
+        slot& s = slots_[h.index()];
+        s.object()->~T();
+        s.live = false;
+        if (++s.generation == 0) s.generation = 1;
+        free_.push_back(h.index());
+        --size_;
+        return true;
+    }
+
+    /// The number of live objects.
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool contains(uint32_t index, uint32_t generation) const
+    {
+        return index < slots_.size() &&
+               slots_[index].generation == generation &&
+               slots_[index].live;
+    }
+
+    template <class U = const T>
+    arena_ref<U, Tag> find(uint32_t index, uint32_t generation)
+    {
+        if (!contains(index, generation)) return nullptr;
+        return arena_ref<U, Tag>(slots_[index].object(), index, generation);
+    }
+
+private:
+    struct slot
+    {
+        uint32_t generation = 1;
+        bool live = false;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* object()
+        {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    slot_arena() = default;
+
+    std::deque<slot> slots_;
+    std::vector<uint32_t> free_;
+    size_t size_ = 0;
+};
+
+template <class T, class Tag>
+struct weak_traits<arena_handle<T, Tag>>
+{
+    using strong_type = arena_ref<T, Tag>;
+    using view_type = strong_type;
+    using const_view_type = view_type;
+    using key_type = T;
+
+    static key_type* key(const view_type& view)
+    {
+        return view.get();
+    }
+
+    static strong_type move(view_type& view)
+    {
+        return std::move(view);
+    }
+};
+
+/// A weak set of objects made by make_intrusive<const Key>.
+template <
+    class Key,
+    class Hash = std::hash<Key>,
+    class KeyEqual = std::equal_to<Key>,
+    class SizePolicy = power_of_two_sizing
+>
+using intrusive_weak_unordered_set =
+        rh_weak_hash_table<intrusive_weak_ptr<const Key>, Hash, KeyEqual,
+                           std::allocator<intrusive_weak_ptr<const Key>>,
+                           SizePolicy>;
+
+/// A weak set of objects in slot_arena<Key, Tag>::instance().
+template <
+    class Key,
+    class Tag = void,
+    class Hash = std::hash<Key>,
+    class KeyEqual = std::equal_to<Key>,
+    class SizePolicy = power_of_two_sizing
+>
+using arena_weak_unordered_set =
+        rh_weak_hash_table<arena_handle<const Key, Tag>, Hash, KeyEqual,
+                           std::allocator<arena_handle<const Key, Tag>>,
+                           SizePolicy>;
+
+} // end namespace intersections::util
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "weak_unordered_set.h"
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace intersections::util {
+
+// Weak tables for keys that are hash-consed, so that equal keys are the
+// same object and equality is identity. They hash and compare keys by
+// address, and keep each key's address in its bucket, so probes never
+// lock a weak pointer or touch a key.
+
+/// Hashes a key by its address, without reading it. Addresses are
+/// mixed, since their low bits are mostly alignment. The mixing is
+/// invertible, so keys with equal hash codes are the same object.
+template <class T>
+struct address_hash
+{
+    size_t operator()(const T& key) const
+    {
+        size_t h = size_t(reinterpret_cast<uintptr_t>(std::addressof(key)));
+        h *= size_t(0x9E3779B97F4A7C15);
+        return h ^ (h >> (sizeof(size_t) * 4));
+    }
+};
+
+/// Compares keys by address, without reading them.
+template <class T>
+struct address_equal
+{
+    bool operator()(const T& a, const T& b) const
+    {
+        return std::addressof(a) == std::addressof(b);
+    }
+};
+
+/// A weak value W that also keeps the address of its key, which it
+/// returns from peek_key even once the key has died. With address_hash
+/// and address_equal, that's all a probe needs, since the table only
+/// takes the address of what peek_key points to. A dead key's address
+/// may be reused by a new key, which then replaces the expired element
+/// in place.
+template <class W>
+struct identity_keyed : W
+{
+    using traits = weak_traits<W>;
+    using key_type = typename traits::key_type;
+    using strong_type = typename traits::strong_type;
+    using view_type = typename traits::view_type;
+    using const_view_type = typename traits::const_view_type;
+
+    identity_keyed(const strong_type& strong)
+            : W(strong), address_(traits::key(strong))
+    { }
+
+    identity_keyed(strong_type&& strong)
+            : identity_keyed(traits::key(strong), std::move(strong))
+    { }
+
+    using W::expired;
+    using W::lock;
+
+    template <class View>
+    static auto key(const View& view)
+    {
+        return traits::key(view);
+    }
+
+    static const key_type* peek_key(const identity_keyed& weak)
+    {
+        return weak.address_;
+    }
+
+    template <class View, class U = W>
+    static auto retain(const View& view)
+            -> decltype(weak_traits<U>::retain(view))
+    {
+        return weak_traits<U>::retain(view);
+    }
+
+private:
+    const key_type* address_;
+
+    // Takes the address first, since moving may empty the strong value,
+    // though not move the key.
+    identity_keyed(const key_type* address, strong_type&& strong)
+            : W(std::move(strong)), address_(address)
+    { }
+};
+
+/// A weak set of hash-consed keys, known by their addresses.
+template <
+    class Key,
+    class Allocator = std::allocator<Key>,
+    class SizePolicy = power_of_two_sizing
+>
+class weak_identity_set
+    : public rh_weak_hash_table<identity_keyed<std::weak_ptr<const Key>>,
+                                address_hash<Key>, address_equal<Key>,
+                                Allocator, SizePolicy>
+{
+    using BaseClass =
+        rh_weak_hash_table<identity_keyed<std::weak_ptr<const Key>>,
+                           address_hash<Key>, address_equal<Key>,
+                           Allocator, SizePolicy>;
+public:
+    using BaseClass::rh_weak_hash_table;
+};
+
+template <class Key, class Allocator, class SizePolicy>
+void swap(weak_identity_set<Key, Allocator, SizePolicy>& a,
+          weak_identity_set<Key, Allocator, SizePolicy>& b)
+{
+    a.swap(b);
+}
+
+/// A side table from hash-consed keys, known by their addresses, to
+/// values, where an entry lives as long as its key, as in
+/// weak_key_unordered_map.
+template <
+    class Key,
+    class Value,
+    class Allocator = std::allocator<weak_key_pair<Key, Value>>,
+    class SizePolicy = power_of_two_sizing
+>
+class weak_identity_map
+    : public weak_unordered_map_base<identity_keyed<weak_key_pair<Key, Value>>,
+                                     address_hash<Key>, address_equal<Key>,
+                                     Allocator, SizePolicy>
+{
+    using BaseClass =
+        weak_unordered_map_base<identity_keyed<weak_key_pair<Key, Value>>,
+                                address_hash<Key>, address_equal<Key>,
+                                Allocator, SizePolicy>;
+public:
+    using BaseClass::weak_unordered_map_base;
+
+    /// Returns the entry for `key`, inserting one with the value made
+    /// from `args` if there is none. The value is made only when
+    /// inserting.
+    template <class... Args>
+    typename BaseClass::strong_value_type
+    try_emplace(const std::shared_ptr<const Key>& key, Args&&... args)
+    {
+        return this->find_or_insert(*key, [&] {
+            return typename BaseClass::strong_value_type(
+                    key, Value(std::forward<Args>(args)...));
+        });
+    }
+};
+
+template <class Key, class Value, class Allocator, class SizePolicy>
+void swap(weak_identity_map<Key, Value, Allocator, SizePolicy>& a,
+          weak_identity_map<Key, Value, Allocator, SizePolicy>& b)
+{
+    a.swap(b);
+}
+
+} // end namespace intersections::util
@@ -1,13 +1,22 @@
 #pragma once
 
+#include "probe_group.h"
 #include "raw_vector.h"
+#include "sizing_policy.h"
+#include "work_stealing_pool.h"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
+#include <cmath>
 #include <initializer_list>
 #include <iterator>
 #include <limits>
 #include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace intersections::util {
 
@@ -26,10 +35,37 @@ struct weak_traits
     /// the type of keys
     using key_type = typename T::key_type;
     /// gets a pointer to a key from a view_type or a strong_type.
-    using T::key;
-    /// steals a view_type, turning it into a strong_type
+    template <class View>
+    static auto key(const View& view)
+    {
+        return T::key(view);
+    }
+    /// OPTIONAL: steals a view_type, turning it into a strong_type. The
+    /// table itself never calls this, moving only weak values.
     /// PRECONDITION: the view_type is not expired
-    using T::move;
+    static strong_type move(view_type& view)
+    {
+        return T::move(view);
+    }
+    /// OPTIONAL: gets a pointer to the key of a weak value, even if it has
+    /// expired, for weak values that store their keys inline. Lets the
+    /// table compare keys without locking.
+    template <class U = T>
+    static auto peek_key(const U& weak) -> decltype(U::peek_key(weak))
+    {
+        return U::peek_key(weak);
+    }
+    /// OPTIONAL: gets just the part of a view_type or a strong_type that
+    /// keeps its element alive, for the table's retention window.
+    /// Without this, the window holds a whole strong_type.
+    template <class View, class U = T>
+    static auto retain(const View& view) -> decltype(U::retain(view))
+    {
+        return U::retain(view);
+    }
+    // OPTIONAL: T may also define `static constexpr bool never_expires`,
+    // true for values that can't expire, which spares the table from
+    // looking for expired ones.
 };
 
 template <class T>
@@ -153,6 +189,10 @@ struct weak_key_pair
             : first(strong.first), second(strong.second)
     { }
 
+    weak_key_pair(strong_type&& strong)
+            : first(strong.first), second(std::move(strong.second))
+    { }
+
     bool expired() const
     {
         return first.expired();
@@ -176,7 +216,15 @@ struct weak_key_pair
             return nullptr;
     }
 
-    static const key_type& key(const strong_type& strong)
+    static const key_type* key(const const_view_type& view)
+    {
+        if (view.first)
+            return view.first.get();
+        else
+            return nullptr;
+    }
+
+    static const key_type* key(const strong_type& strong)
     {
         return strong.first.get();
     }
@@ -185,6 +233,12 @@ struct weak_key_pair
     {
         return {std::move(view.first), std::move(view.second)};
     }
+
+    template <class View>
+    static key_pointer retain(const View& view)
+    {
+        return view.first;
+    }
 };
 
 template <class Key, class Value,
@@ -229,19 +283,32 @@ struct weak_value_pair
         return &strong.first;
     }
 
+    static const key_type* peek_key(const weak_value_pair& weak)
+    {
+        return &weak.first;
+    }
+
     static strong_type move(view_type& view)
     {
         return {std::move(const_cast<key_type&>(view.first)),
                 std::move(view.second)};
     }
+
+    template <class View>
+    static value_pointer retain(const View& view)
+    {
+        return view.second;
+    }
 };
 
-/// A weak Robin Hood hash table.
+/// A weak Robin Hood hash table. SizePolicy chooses the bucket counts
+/// and maps hash codes to buckets (see sizing_policy.h).
 template <
     class T,
     class Hash = std::hash<typename weak_traits<T>::key_type>,
     class KeyEqual = std::equal_to<typename weak_traits<T>::key_type>,
-    class Allocator = std::allocator<T>
+    class Allocator = std::allocator<T>,
+    class SizePolicy = power_of_two_sizing
 >
 class rh_weak_hash_table
 {
@@ -255,50 +322,61 @@ public:
     using hasher                = Hash;
     using key_equal             = KeyEqual;
     using allocator_type        = Allocator;
+    using size_policy           = SizePolicy;
 
 private:
-    // We're going to steal a bit from the hash codes to store a used bit..
-    // So the number of hash bits is one less than the number of bits in size_t.
-    static constexpr size_t number_of_hash_bits_ =
-        sizeof(size_t) * CHAR_BIT - 1;
-
-    static constexpr size_t hash_code_mask_ =
-        (size_t(1) << number_of_hash_bits_) - 1;
-
-    // This class lifts the client-provided hasher to a hasher that masks out
-    // the high bit.
+    template <class W, class = void>
+    struct has_is_transparent : std::false_type { };
+
+    template <class W>
+    struct has_is_transparent<W, std::void_t<typename W::is_transparent>>
+        : std::true_type { };
+
+    // Whether lookups accept keys of type K, besides key_type. (It
+    // doesn't depend on K, apart from leaving key_type to the plain
+    // overloads, but has to mention K to be used for SFINAE.)
+    template <class K>
+    static constexpr bool is_transparent_ =
+            has_is_transparent<Hash>::value &&
+            has_is_transparent<KeyEqual>::value &&
+            !std::is_same_v<K, std::remove_const_t<key_type>>;
+
+    template <class K>
+    static constexpr bool accepts_key_ =
+            std::is_same_v<K, std::remove_const_t<key_type>> ||
+            is_transparent_<K>;
+
+    // This class wraps the client-provided hasher.
     class real_hasher
     {
     public:
         explicit real_hasher(const Hash& hash) : hash_(hash) { }
 
-        size_t operator()(const key_type& key) const
+        template <class K>
+        size_t operator()(const K& key) const
         {
-            return hash_(key) & hash_code_mask_;
+            return hash_(key);
         }
 
     private:
         Hash hash_;
     };
 
-    // We store the weak pointers in buckets along with a used bit and the
-    // hash code for each bucket. hash_code_ is only valid if ptr_ is non-null.
+    // We store the weak pointers in buckets along with the hash code for
+    // each bucket. Whether a bucket is used is kept separately, in its
+    // control byte (see probe_group.h), so that probes can skim the
+    // control bytes without dragging whole buckets through the cache.
+    // value_ and hash_code_ are only valid if the bucket is used.
     class Bucket
     {
     public:
         Bucket()
-                : used_(0), hash_code_(0)
+                : hash_code_(0)
         { }
 
-        bool occupied() const
-        {
-            return used_ && !value_.expired();
-        }
-
     private:
         weak_value_type value_;
-        size_t          used_ : 1,
-                        hash_code_ : number_of_hash_bits_;
+        size_t          hash_code_;
 
         friend class rh_weak_hash_table;
     };
@@ -310,7 +388,12 @@ private:
         typename std::allocator_traits<allocator_type>
                      ::template rebind_alloc<weak_value_type>;
 
+    using ctrl_allocator_type =
+        typename std::allocator_traits<allocator_type>
+                     ::template rebind_alloc<ctrl_t>;
+
     using vector_t = raw_vector<Bucket, bucket_allocator_type>;
+    using ctrl_vector_t = raw_vector<ctrl_t, ctrl_allocator_type>;
 
 public:
 
@@ -370,9 +453,7 @@ public:
                        const allocator_type& allocator = allocator_type())
         : rh_weak_hash_table(bucket_count, hash, equal, allocator)
     {
-        for ( ; first != last; ++first) {
-            insert(*first);
-        }
+        insert(first, last);
     }
 
     /// Constructs a new weak hash table of the given bucket count,
@@ -413,9 +494,14 @@ private:
         , equal_(equal)
         , bucket_allocator_(bucket_allocator)
         , weak_value_allocator_(weak_value_allocator)
-        , buckets_(bucket_count, bucket_allocator_)
+        , buckets_(size_policy::round_up(bucket_count), bucket_allocator_)
+        , ctrl_(ctrl_size_(buckets_.size()),
+                ctrl_allocator_type(bucket_allocator))
         , size_(0)
+        , old_buckets_(0, bucket_allocator_)
+        , old_ctrl_(0, ctrl_allocator_type(bucket_allocator))
     {
+        size_policy_.reset(buckets_.size());
         init_buckets_();
     }
 
@@ -425,12 +511,15 @@ public:
     rh_weak_hash_table(const rh_weak_hash_table& other)
         : rh_weak_hash_table(other.size(),
                              other.hash_,
+                             other.equal_,
                              other.bucket_allocator_,
                              other.weak_value_allocator_)
     {
         for (const auto& each : other) {
             insert(each);
         }
+
+        copy_settings_(other);
     }
 
     /// Copy constructor with allocator.
@@ -438,18 +527,22 @@ public:
                        const allocator_type& allocator)
             : rh_weak_hash_table(other.size(),
                                  other.hash_,
-                                 allocator,
-                                 allocator)
+                                 other.equal_,
+                                 bucket_allocator_type(allocator),
+                                 weak_value_allocator_type(allocator))
     {
         for (const auto& each : other) {
             insert(each);
         }
+
+        copy_settings_(other);
     }
 
     /// Move constructor.
     rh_weak_hash_table(rh_weak_hash_table&& other)
         : rh_weak_hash_table(0,
                              other.hash_,
+                             other.equal_,
                              other.bucket_allocator_,
                              other.weak_value_allocator_)
     {
@@ -459,7 +552,9 @@ public:
     /// Move constructor with allocator.
     rh_weak_hash_table(rh_weak_hash_table&& other,
                        const allocator_type& allocator)
-        : rh_weak_hash_table(0, other.hash_, allocator, allocator)
+        : rh_weak_hash_table(0, other.hash_, other.equal_,
+                             bucket_allocator_type(allocator),
+                             weak_value_allocator_type(allocator))
     {
         swap(other);
         bucket_allocator_ = allocator;
@@ -500,6 +595,7 @@ public:
 
     ~rh_weak_hash_table()
     {
+        if (evictor_) evictor_->table = nullptr;
         clear();
     }
 
@@ -527,377 +623,1819 @@ public:
     /// Removes all elements.
     void clear()
     {
-        for (auto& bucket : buckets_) {
-            if (bucket.used_) {
-                destroy_bucket_(bucket);
+        for (size_t pos = 0; pos < bucket_count(); ++pos) {
+            if (used_(pos)) {
+                destroy_bucket_(pos);
             }
         }
 
+        for (size_t pos = 0; pos < old_buckets_.size(); ++pos) {
+            if (old_ctrl_[pos] >= 0) {
+                destroy_value_(old_buckets_[pos]);
+            }
+        }
+
+        old_buckets_.clear();
+        old_ctrl_.clear();
         size_ = 0;
+
+        // Once the table is empty, in case letting go evicts.
+        for (auto& each : retained_) each = retained_type_();
     }
 
-    /// Cleans up expired elements. After this, `size()` is accurate.
-    void remove_expired()
+    /// Sets how many buckets each insertion or erasure moves while the
+    /// table is growing. The default, 0, rehashes every element at once
+    /// when the table grows, which can stall a large table for a long
+    /// time. Otherwise growing allocates the new buckets but leaves the
+    /// elements where they are, and later operations move them a few
+    /// at a time, bounding the latency of each. Steps smaller than 2
+    /// are rounded up to 2, which ensures that each rehash finishes
+    /// before the table needs to grow again.
+    void set_rehash_step(size_t step)
     {
-        for (auto& bucket : buckets_) {
-            if (bucket.used_ && bucket.value_.expired()) {
-                destroy_bucket_(bucket);
-                --size_;
-            }
+        if (step == 0) {
+            finish_rehash_();
+            rehash_step_ = 0;
+        } else {
+            rehash_step_ = step < 2 ? 2 : step;
         }
     }
 
-    /// Inserts an element.
-    void insert(const strong_value_type& value)
+    size_t rehash_step() const
     {
-        if (bucket_count() < 1) resize_(default_bucket_count);
-        insert_(hash_(*weak_trait::key(value)), value);
-        maybe_grow_();
+        return rehash_step_;
     }
 
-    /// Inserts an element.
-    void insert(strong_value_type&& value)
+    /// Whether an incremental rehash is under way, in which case some
+    /// elements are still in the old buckets.
+    bool rehashing() const
     {
-        if (bucket_count() < 1) resize_(default_bucket_count);
-        size_t hash_code = hash_(*weak_trait::key(value));
-        insert_(hash_code, std::move(value));
-        maybe_grow_();
+        return !old_buckets_.empty();
     }
 
-    /// Erases the element if the given key, returning whether an
-    /// element was actually erased.
-    bool erase(const key_type& key)
+    /// Sets how many buckets each insertion examines for expired
+    /// elements, in a sweep that cycles through the table. The default,
+    /// 0, leaves expired elements until something else finds them,
+    /// which lets `size()` drift above the number of live elements.
+    void set_sweep_step(size_t step)
     {
-        if (Bucket* bucket = lookup_(key)) {
-            destroy_bucket_(*bucket);
-            --size;
-            return true;
-        } else {
-            return false;
-        }
+        sweep_step_ = step;
     }
 
-    /// Swaps this weak hash table with another in constant time.
-    void swap(rh_weak_hash_table& other)
+    size_t sweep_step() const
     {
-        using std::swap;
-        swap(buckets_, other.buckets_);
-        swap(size_, other.size_);
-        swap(hash_, other.hash_);
-        swap(equal_, other.equal_);
-        swap(bucket_allocator_, other.bucket_allocator_);
-        swap(weak_value_allocator_, other.weak_value_allocator_);
+        return sweep_step_;
     }
 
-    /// Is the given key mapped by this hash table?
-    bool member(const key_type& key) const
+    /// Sets the load factor below which the table shrinks, as erasures
+    /// and sweeps bring it down. Shrinking leaves room for the table to
+    /// double before growing again. The default, 0, never shrinks.
+    /// Ratios above a quarter of grow_at_ratio are lowered to that, so
+    /// that a table that has just shrunk doesn't shrink again right away.
+    void set_shrink_at_ratio(double ratio)
     {
-        return lookup_(key) != nullptr;
+        shrink_at_ratio_ = std::min(ratio, grow_at_ratio / 4);
     }
 
-    size_t count(const key_type& key) const
+    double shrink_at_ratio() const
     {
-        return member(key)? 1 : 0;
+        return shrink_at_ratio_;
     }
 
-    class iterator;
-    class const_iterator;
-
-    iterator find(const key_type& key)
+    /// Sets the size of the retention window, a ring of strong references
+    /// to the elements of the last `count` hits: the elements that find
+    /// and find_or_insert look up or insert, with repeated hits on one
+    /// element counting once. An element that everyone else drops lives
+    /// on until `count` more hits go by, so one that's dropped and made
+    /// again a moment later is found rather than made anew. The default,
+    /// 0, holds nothing. Changing the size empties the window. Lookups
+    /// through a const table don't count as hits, so they leave the
+    /// window alone and stay safe to make from many threads at once.
+    /// Tables whose elements can't expire ignore this.
+    void set_retention_window(size_t count)
     {
-        if (auto bucket = lookup_(key)) {
-            return {bucket, buckets_.end()};
-        } else {
-            return end();
+        if constexpr (can_expire_) {
+            busy_scope busy(*this);
+            retained_vector_t().swap(retained_);
+            retained_.resize(count);
+            retain_pos_ = 0;
+            last_retained_hash_ = 0;
         }
     }
 
-    const_iterator find(const key_type& key) const
+    size_t retention_window() const
     {
-        if (auto bucket = lookup_(key)) {
-            return {bucket, buckets_.end()};
-        } else {
-            return end();
-        }
+        return retained_.size();
     }
 
-    iterator begin()
+    /// Sets the bucket count to at least `count`, and enough to hold the
+    /// live elements without growing, rehashing all of them at once.
+    /// Removes expired elements.
+    void rehash(size_t count)
     {
-        return {buckets_.begin(), buckets_.end()};
+        busy_scope busy(*this);
+        remove_expired_();
+        resize_(std::max(count, buckets_needed_(size_)));
     }
 
-    iterator end()
+    /// Makes room for `count` elements without growing. Automatic
+    /// shrinking won't go below this until shrink_to_fit.
+    void reserve(size_t count)
     {
-        return {buckets_.end(), buckets_.end()};
+        reserved_ = buckets_needed_(count);
+        if (reserved_ > bucket_count()) rehash(reserved_);
     }
 
-    iterator begin() const
+    /// Reduces the bucket count to the least that holds the live
+    /// elements, returning the rest of the memory.
+    void shrink_to_fit()
     {
-        return {buckets_.begin(), buckets_.end()};
+        reserved_ = 0;
+        rehash(0);
     }
 
-    iterator end() const
+    /// Cleans up expired elements. After this, `size()` is accurate.
+    void remove_expired()
     {
-        return {buckets_.end(), buckets_.end()};
+        busy_scope busy(*this);
+        remove_expired_();
+        maybe_shrink_();
     }
 
-    const_iterator cbegin() const
+    // These do the same as rehash and remove_expired, but divide the
+    // buckets among the threads of `pool`, which pays off only for big
+    // tables; smaller ones are done on this thread. They must not be
+    // called from one of the pool's threads.
+
+    void rehash(size_t count, work_stealing_pool& pool)
     {
-        return begin();
+        busy_scope busy(*this);
+        remove_expired_(pool);
+        resize_(std::max(count, buckets_needed_(size_)), pool);
     }
 
-    const_iterator cend() const
+    void remove_expired(work_stealing_pool& pool)
     {
-        return end();
+        busy_scope busy(*this);
+        remove_expired_(pool);
+        maybe_shrink_();
     }
 
-private:
-    real_hasher hash_;
-    key_equal equal_;
-    bucket_allocator_type bucket_allocator_;
-    weak_value_allocator_type weak_value_allocator_;
-
-    vector_t buckets_;
-    size_t size_;
+    /// Inserts an element.
+    void insert(const strong_value_type& value)
+    {
+        busy_scope busy(*this);
+        if (bucket_count() < 1) resize_(default_bucket_count);
+        insert_(hash_(*weak_trait::key(value)), value);
+        after_insert_();
+    }
 
-    void maybe_grow_()
+    /// Inserts an element.
+    void insert(strong_value_type&& value)
     {
-        auto cap = bucket_count();
-        if (double(size_)/double(cap) > grow_at_ratio) {
-            resize_(2 * cap);
-        }
+        busy_scope busy(*this);
+        if (bucket_count() < 1) resize_(default_bucket_count);
+        size_t hash_code = hash_(*weak_trait::key(value));
+        insert_(hash_code, std::move(value));
+        after_insert_();
     }
 
-    void resize_(size_t new_bucket_count)
+    /// Inserts the elements of [first, last). Given forward iterators,
+    /// it hashes the whole batch and makes room for it first, and then
+    /// prefetches each element's bucket a few elements ahead of
+    /// inserting it, so that the cache misses overlap.
+    template <class InputIt>
+    void insert(InputIt first, InputIt last)
     {
-        assert(new_bucket_count > size_);
+        using category =
+            typename std::iterator_traits<InputIt>::iterator_category;
 
-        using std::swap;
-        vector_t old_buckets(new_bucket_count, bucket_allocator_);
-        swap(old_buckets, buckets_);
-        size_ = 0;
-        init_buckets_();
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag,
+                                        category>) {
+            busy_scope busy(*this);
 
-        for (Bucket& bucket : old_buckets) {
-            if (bucket.used_) {
-                auto&& value = bucket.value_.lock();
-                if (weak_trait::key(value)) {
-                    insert_(bucket.hash_code_, weak_trait::move(value));
-                }
-            }
-        }
-    }
+            std::vector<size_t> hash_codes;
+            for (auto i = first; i != last; ++i)
+                hash_codes.push_back(hash_(*weak_trait::key(*i)));
 
-    const Bucket* lookup_(const key_type& key) const
-    {
-        size_t hash_code = hash_(key);
-        size_t pos = which_bucket_(hash_code);
-        size_t dist = 0;
+            size_t needed = buckets_needed_(size_ + hash_codes.size());
+            if (needed > bucket_count()) resize_(needed);
 
-        for (;;) {
-            const Bucket& bucket = buckets_[pos];
-            if (!bucket.used_)
-                return nullptr;
+            for (size_t i = 0; i < hash_codes.size(); ++i, ++first) {
+                if (i + prefetch_distance < hash_codes.size())
+                    prefetch_(hash_codes[i + prefetch_distance]);
 
-            if (dist > probe_distance_(pos, which_bucket_(bucket.hash_code_)))
-                return nullptr;
+                insert_(hash_codes[i], *first);
 
-            if (hash_code == bucket.hash_code_) {
-                auto locked = bucket.value_.lock();
-                if (const auto* key = weak_trait::key(locked))
-                    if (equal_(*locked, *key))
-                        return &bucket;
+                // Shrinking in the middle would undo the presizing.
+                sweep_some_(sweep_step_);
+                maybe_grow_();
+                rehash_some_(rehash_step_);
             }
 
-            pos = next_bucket_(pos);
-            ++dist;
+            maybe_shrink_();
+        } else {
+            for ( ; first != last; ++first)
+                insert(*first);
         }
     }
 
-    Bucket* lookup_(const key_type& key)
+    /// Returns the element with the given key, if there is one. Otherwise
+    /// inserts and returns `factory()`, whose key must equal `key`. This
+    /// takes one probe, where finding and then inserting would take two.
+    /// The factory must not modify the table.
+    template <class K, class F, class = std::enable_if_t<accepts_key_<K>>>
+    strong_value_type find_or_insert(const K& key, F&& factory)
     {
-        auto const_this = const_cast<const rh_weak_hash_table*>(this);
-        auto bucket = const_this->lookup_(key);
-        return const_cast<Bucket*>(bucket);
+        return find_or_insert(key, hash_(key), std::forward<F>(factory));
     }
 
-    // Based on https://www.sebastiansylvan.com/post/robin-hood-hashing-should-be-your-default-hash-table-implementation/
-    void insert_(size_t hash_code, strong_value_type value)
+    template <class K, class F, class = std::enable_if_t<accepts_key_<K>>>
+    strong_value_type find_or_insert(const K& key, size_t hash_code,
+                                     F&& factory)
     {
-        size_t pos = which_bucket_(hash_code);
-        size_t dist = 0;
-
-        for (;;) {
-            Bucket& bucket = buckets_[pos];
+        busy_scope busy(*this);
+        if (bucket_count() < 1) resize_(default_bucket_count);
 
-            // If the bucket is unoccupied, use it:
-            if (!bucket.used_) {
-                std::allocator_traits<weak_value_allocator_type>::construct(
-                        weak_value_allocator_,
-                        &bucket.value_,
-                        std::move(value));
-                bucket.hash_code_ = hash_code;
-                bucket.used_ = 1;
-                ++size_;
-                return;
+        if (rehashing()) {
+            probe_hit_ hit;
+            size_t old_pos = lookup_in_(old_buckets_, old_ctrl_,
+                                        old_size_policy_, key, hash_code,
+                                        &hit);
+            if (old_pos != npos_) {
+                auto&& view = hit_view_(old_buckets_[old_pos], hit);
+                if (weak_trait::key(view)) {
+                    retain_(hash_code, view);
+                    return strong_value_type(view);
+                }
             }
+        }
 
-            // Check if the pointer is expired. If it is, use this slot.
-            auto bucket_locked = bucket.value_.lock();
-            auto bucket_key = weak_trait::key(bucket_locked);
-            if (!bucket_key) {
-                bucket.value_ = std::move(value);
-                bucket.hash_code_ = hash_code;
-                return;
-            }
+        size_t pos, dist;
+        probe_hit_ hit;
+        bool found = probe_(key, hash_code, pos, dist, &hit);
 
-            // If not expired, but matches the value to insert, replace.
-            auto key = weak_trait::key(value);
-            if (hash_code == bucket.hash_code_ && equal_(*bucket_key, *key)) {
-                bucket.value_ = std::move(value);
-                return;
+        if (found) {
+            auto&& view = hit_view_(buckets_[pos], hit);
+            if (weak_trait::key(view)) {
+                retain_(hash_code, view);
+                return strong_value_type(view);
             }
+        }
 
-            // Otherwise, we check the probe distance.
-            size_t existing_distance =
-                probe_distance_(pos, which_bucket_(bucket.hash_code_));
-            if (dist > existing_distance) {
-                bucket.value_ = std::exchange(value,
-                                              weak_trait::move(bucket_locked));
-                size_t tmp = bucket.hash_code_;
-                bucket.hash_code_ = hash_code;
-                hash_code = tmp;
-                dist = existing_distance;
-            }
+        strong_value_type value = factory();
+        assert(hash_(*weak_trait::key(value)) == hash_code);
 
-            pos = next_bucket_(pos);
-            ++dist;
+        if (found) {
+            // It's expired, but with its key stored inline.
+            buckets_[pos].value_ = weak_value_type(value);
+        } else {
+            place_(pos, dist, hash_code, weak_value_type(value));
         }
-    }
 
-    void destroy_bucket_(Bucket& bucket)
-    {
-        std::allocator_traits<weak_value_allocator_type>::destroy(
-            weak_value_allocator_,
-            &bucket.value_);
-        bucket.used_ = 0;
+        retain_(hash_code, value);
+        after_insert_();
+        return value;
     }
 
-    void init_buckets_()
+    /// Erases the element if the given key, returning whether an
+    /// element was actually erased.
+    bool erase(const key_type& key)
     {
-        for (auto& bucket : buckets_)
-            bucket.used_ = 0;
+        busy_scope busy(*this);
+        size_t hash_code = hash_(key);
+
+        size_t pos = lookup_in_(buckets_, ctrl_, size_policy_,
+                                key, hash_code);
+        if (pos != npos_) {
+            erase_at_(pos);
+        } else if (rehashing() &&
+                   (pos = lookup_in_(old_buckets_, old_ctrl_,
+                                     old_size_policy_, key, hash_code))
+                       != npos_) {
+            erase_old_(pos);
+        } else {
+            return false;
+        }
+
+        rehash_some_(rehash_step_);
+        maybe_shrink_();
+        return true;
     }
 
-    size_t next_bucket_(size_t pos) const
+    /// Swaps this weak hash table with another in constant time.
+    void swap(rh_weak_hash_table& other)
     {
-        return (pos + 1) % bucket_count();
+        using std::swap;
+        swap(buckets_, other.buckets_);
+        swap(ctrl_, other.ctrl_);
+        swap(size_, other.size_);
+        swap(size_policy_, other.size_policy_);
+        swap(old_buckets_, other.old_buckets_);
+        swap(old_ctrl_, other.old_ctrl_);
+        swap(old_size_policy_, other.old_size_policy_);
+        swap(rehash_pos_, other.rehash_pos_);
+        swap(rehash_step_, other.rehash_step_);
+        swap(sweep_pos_, other.sweep_pos_);
+        swap(sweep_step_, other.sweep_step_);
+        swap(shrink_at_ratio_, other.shrink_at_ratio_);
+        swap(reserved_, other.reserved_);
+        swap(hash_, other.hash_);
+        swap(equal_, other.equal_);
+        swap(bucket_allocator_, other.bucket_allocator_);
+        swap(weak_value_allocator_, other.weak_value_allocator_);
+        swap(retained_, other.retained_);
+        swap(retain_pos_, other.retain_pos_);
+        swap(last_retained_hash_, other.last_retained_hash_);
+
+        swap(evictor_, other.evictor_);
+        if (evictor_) evictor_->table = this;
+        if (other.evictor_) other.evictor_->table = &other;
+    }
+
+    /// Makes a new key, constructed from `args`, that erases its own
+    /// entry from this table as soon as it dies, rather than leaving it
+    /// to expire. This keeps `size()` exact. Also, unlike with
+    /// std::make_shared, the key's memory is freed when it dies, rather
+    /// than when the table lets go of its weak pointer.
+    ///
+    /// Eviction happens on whichever thread drops the last reference,
+    /// so if that may race with other uses of the table, they need to
+    /// share a lock. If the key dies while the table is busy, in the
+    /// middle of an operation or with an iterator alive, its eviction
+    /// waits until the table is no longer busy. Eviction never resizes
+    /// the table; shrinking waits for the next insertion or erasure.
+    ///
+    /// Only tables that hold their keys weakly, like weak_unordered_set
+    /// and weak_key_unordered_map, have this: elsewhere, the table keeps
+    /// its own copy of the key, which the new key's death wouldn't touch.
+    template <class... Args>
+    std::shared_ptr<const key_type> make_evicting(Args&&... args)
+    {
+        static_assert(has_weak_keys_,
+                      "make_evicting needs a table with weakly held keys");
+
+        if (!evictor_) evictor_ = std::make_shared<eviction_handle>(this);
+
+        auto key = std::make_unique<key_type>(std::forward<Args>(args)...);
+        size_t hash_code = hash_(*key);
+        return std::shared_ptr<const key_type>(
+                key.release(), evicting_deleter{evictor_, hash_code});
+    }
+
+    // Lookups may pass the key's hash code, if it's already known.
+    // If both Hash and KeyEqual define is_transparent, lookups also
+    // accept any type of key that they accept, which saves building a
+    // key_type just to look for it.
+
+    /// Looks up each key in [first, last), writing a const_iterator to
+    /// `out` for each: end() for keys that aren't found. Like the batch
+    /// insert, it hashes the keys first and prefetches ahead.
+    template <class ForwardIt, class OutputIt>
+    OutputIt find_many(ForwardIt first, ForwardIt last, OutputIt out) const
+    {
+        std::vector<size_t> hash_codes;
+        for (auto i = first; i != last; ++i)
+            hash_codes.push_back(hash_(*i));
+
+        for (size_t i = 0; i < hash_codes.size(); ++i, ++first) {
+            if (i + prefetch_distance < hash_codes.size())
+                prefetch_(hash_codes[i + prefetch_distance]);
+
+            *out++ = find(*first, hash_codes[i]);
+        }
+
+        return out;
     }
 
-    size_t probe_distance_(size_t actual, size_t preferred) const
+    /// Is the given key mapped by this hash table?
+    bool member(const key_type& key) const
     {
-        if (actual >= preferred)
-            return actual - preferred;
-        else
-            return actual + bucket_count() - preferred;
+        return member(key, hash_(key));
     }
 
-    size_t which_bucket_(size_t hash_code) const
+    bool member(const key_type& key, size_t hash_code) const
     {
-        return hash_code % bucket_count();
+        return lookup_(key, hash_code) != nullptr;
     }
-};
-
-template <
-    class T,
-    class Hash,
-    class KeyEqual,
-    class Allocator
->
-class rh_weak_hash_table<T, Hash, KeyEqual, Allocator>::iterator
-        : public std::iterator<std::forward_iterator_tag, T>
-{
-public:
-    using base_t = typename vector_t::iterator;
 
-    iterator(base_t start, base_t limit)
-            : base_(start), limit_(limit)
+    template <class K, class = std::enable_if_t<is_transparent_<K>>>
+    bool member(const K& key) const
     {
-        find_next_();
+        return member(key, hash_(key));
     }
 
-    view_value_type operator*() const
+    template <class K, class = std::enable_if_t<is_transparent_<K>>>
+    bool member(const K& key, size_t hash_code) const
     {
-        return base_->value_.lock();
+        return lookup_(key, hash_code) != nullptr;
     }
 
-    iterator& operator++()
+    size_t count(const key_type& key) const
     {
-        ++base_;
-        find_next_();
-        return *this;
+        return member(key)? 1 : 0;
     }
 
-    iterator operator++(int)
+    template <class K, class = std::enable_if_t<is_transparent_<K>>>
+    size_t count(const K& key) const
     {
-        auto old = *this;
-        ++*this;
-        return old;
+        return member(key)? 1 : 0;
     }
 
-    bool operator==(iterator other)
+    /// Calls `f(view)` for each live element, where `view` is what
+    /// dereferencing an iterator would return, and keeps the element
+    /// alive for the call. Unlike iterating, this locks each element just
+    /// once, and skips empty buckets a whole probe_group at a time. `f`
+    /// must not modify the table. Keys that die meanwhile are evicted
+    /// once the traversal is done.
+    template <class F>
+    void for_each_live(F f)
     {
-        return base_ == other.base_;
+        busy_scope busy(*this);
+        for_each_live_in_(buckets_, ctrl_, f);
+        for_each_live_in_(old_buckets_, old_ctrl_, f);
     }
 
-    bool operator!=(iterator other)
+    template <class F>
+    void for_each_live(F f) const
     {
-        return base_ != other.base_;
+        busy_scope busy(*this);
+        for_each_live_in_(buckets_, ctrl_, f);
+        for_each_live_in_(old_buckets_, old_ctrl_, f);
     }
 
-private:
-    // Invariant: if base_ != limit_ then base_->occupied();
-    base_t base_;
-    base_t limit_;
+    class iterator;
+    class const_iterator;
 
-    void find_next_()
+    // Iterators visit buckets_ and then old_buckets_, which is empty
+    // unless rehashing.
+
+    iterator find(const key_type& key)
     {
-        while (base_ != limit_ && !base_->occupied())
-            ++base_;
+        return find_(key, hash_(key));
     }
-};
-
-template <
-    class T,
-    class Hash,
-    class KeyEqual,
-    class Allocator
->
-class rh_weak_hash_table<T, Hash, KeyEqual, Allocator>::const_iterator
-        : public std::iterator<std::forward_iterator_tag, const T>
-{
-public:
-    using base_t = typename vector_t::const_iterator;
 
-    const_iterator(base_t start, base_t limit)
-            : base_(start), limit_(limit)
+    iterator find(const key_type& key, size_t hash_code)
     {
-        find_next_();
+        return find_(key, hash_code);
     }
 
-    const_iterator(iterator other)
-            : base_(other.base_), limit_(other.limit_)
-    { }
-
-    const_view_value_type operator*() const
+    template <class K, class = std::enable_if_t<is_transparent_<K>>>
+    iterator find(const K& key)
     {
-        return base_->value_.lock();
+        return find_(key, hash_(key));
     }
 
-    const_iterator& operator++()
+    template <class K, class = std::enable_if_t<is_transparent_<K>>>
+    iterator find(const K& key, size_t hash_code)
+    {
+        return find_(key, hash_code);
+    }
+
+    const_iterator find(const key_type& key) const
+    {
+        return const_cast<rh_weak_hash_table*>(this)
+                ->template find_<false>(key, hash_(key));
+    }
+
+    const_iterator find(const key_type& key, size_t hash_code) const
+    {
+        return const_cast<rh_weak_hash_table*>(this)
+                ->template find_<false>(key, hash_code);
+    }
+
+    template <class K, class = std::enable_if_t<is_transparent_<K>>>
+    const_iterator find(const K& key) const
+    {
+        return const_cast<rh_weak_hash_table*>(this)
+                ->template find_<false>(key, hash_(key));
+    }
+
+    template <class K, class = std::enable_if_t<is_transparent_<K>>>
+    const_iterator find(const K& key, size_t hash_code) const
+    {
+        return const_cast<rh_weak_hash_table*>(this)
+                ->template find_<false>(key, hash_code);
+    }
+
+    iterator begin()
+    {
+        return busy_iterator_(iterator(
+                buckets_.begin(), buckets_.end(), ctrl_.begin(),
+                old_buckets_.begin(), old_buckets_.end(), old_ctrl_.begin()));
+    }
+
+    iterator end()
+    {
+        return {old_buckets_.end(), old_buckets_.end(), nullptr};
+    }
+
+    const_iterator begin() const
+    {
+        return const_cast<rh_weak_hash_table*>(this)->begin();
+    }
+
+    const_iterator end() const
+    {
+        return const_cast<rh_weak_hash_table*>(this)->end();
+    }
+
+    const_iterator cbegin() const
+    {
+        return begin();
+    }
+
+    const_iterator cend() const
+    {
+        return end();
+    }
+
+protected:
+    // Like find_or_insert, whose precondition on the factory's key it
+    // shares, but returns a view into the element's bucket rather than a
+    // copy of it, for rh_unordered_map::operator[]. It does the upkeep
+    // of an insertion before the probe, so nothing moves the element
+    // while the caller holds the view; on a hit, the table may thus grow
+    // one insertion early. Since an eviction could move it too, only
+    // tables whose elements never expire may use this.
+    template <class K, class F>
+    view_value_type find_or_insert_in_place_(const K& key, F&& factory)
+    {
+        static_assert(!can_expire_,
+                      "views into buckets last only while nothing expires");
+
+        busy_scope busy(*this);
+        size_t hash_code = hash_(key);
+        if (bucket_count() < 1) resize_(default_bucket_count);
+
+        maybe_grow_(1);
+        rehash_some_(rehash_step_);
+
+        if (rehashing()) {
+            size_t old_pos = lookup_in_(old_buckets_, old_ctrl_,
+                                        old_size_policy_, key, hash_code);
+            if (old_pos != npos_) return old_buckets_[old_pos].value_.lock();
+        }
+
+        size_t pos, dist;
+        if (!probe_(key, hash_code, pos, dist)) {
+            strong_value_type value = factory();
+            pos = place_(pos, dist, hash_code,
+                         weak_value_type(std::move(value)));
+        }
+
+        return buckets_[pos].value_.lock();
+    }
+
+private:
+    // Only non-const lookups Retain, which writes to the table. Since
+    // retaining may drop an older element, whose eviction mustn't move
+    // the one found, they count as busy. The const ones cast away const
+    // just to build an iterator.
+    template <bool Retain = true, class K>
+    iterator find_(const K& key, size_t hash_code)
+    {
+        std::optional<busy_scope> busy;
+        if constexpr (Retain) busy.emplace(*this);
+
+        probe_hit_ hit;
+        probe_hit_* want_hit = Retain && !retained_.empty() ? &hit : nullptr;
+
+        size_t pos = lookup_in_(buckets_, ctrl_, size_policy_,
+                                key, hash_code, want_hit);
+        if (pos != npos_) {
+            if constexpr (Retain)
+                retain_bucket_(buckets_[pos], hash_code, hit);
+            return busy_iterator_(iterator(
+                    buckets_.begin() + pos, buckets_.end(), &ctrl_[pos],
+                    old_buckets_.begin(), old_buckets_.end(),
+                    old_ctrl_.begin()));
+        }
+
+        if (rehashing()) {
+            pos = lookup_in_(old_buckets_, old_ctrl_, old_size_policy_,
+                             key, hash_code, want_hit);
+            if (pos != npos_) {
+                if constexpr (Retain)
+                    retain_bucket_(old_buckets_[pos], hash_code, hit);
+                return busy_iterator_(iterator(
+                        old_buckets_.begin() + pos, old_buckets_.end(),
+                        &old_ctrl_[pos]));
+            }
+        }
+
+        return end();
+    }
+
+    real_hasher hash_;
+    key_equal equal_;
+    bucket_allocator_type bucket_allocator_;
+    weak_value_allocator_type weak_value_allocator_;
+
+    vector_t buckets_;
+    ctrl_vector_t ctrl_;
+    size_t size_;
+    size_policy size_policy_;
+
+    // During an incremental rehash, the buckets that elements are moving
+    // out of. Every bucket before rehash_pos_ has been moved, and moved
+    // buckets are marked ctrl_deleted so that lookups of elements still
+    // here probe past them.
+    vector_t old_buckets_;
+    ctrl_vector_t old_ctrl_;
+    size_policy old_size_policy_;
+    size_t rehash_pos_ = 0;
+    size_t rehash_step_ = 0;
+
+    // The next bucket for the incremental sweep to examine.
+    size_t sweep_pos_ = 0;
+    size_t sweep_step_ = 0;
+
+    double shrink_at_ratio_ = 0;
+
+    // The bucket count asked for by reserve.
+    size_t reserved_ = 0;
+
+    // Lets the deleters made by make_evicting find the table, if it
+    // still exists.
+    struct eviction_handle
+    {
+        explicit eviction_handle(rh_weak_hash_table* table) : table(table)
+        { }
+
+        rh_weak_hash_table* table;
+        size_t busy = 0;
+
+        // The hash codes of keys that died while the table was busy.
+        std::vector<size_t> pending;
+
+        void release()
+        {
+            if (--busy == 0 && !pending.empty()) evict_pending();
+        }
+
+        // Evicts while marked busy, so that keys dying meanwhile queue
+        // up behind, rather than evicting in the middle.
+        void evict_pending()
+        {
+            ++busy;
+            while (!pending.empty()) {
+                size_t hash_code = pending.back();
+                pending.pop_back();
+                if (table) table->evict_(hash_code);
+            }
+            --busy;
+        }
+    };
+
+    struct evicting_deleter
+    {
+        std::shared_ptr<eviction_handle> handle;
+        size_t hash_code;
+
+        void operator()(const key_type* key) const
+        {
+            delete key;
+            if (!handle->table) return;
+
+            // If there's no room to queue it, the entry is left to
+            // expire normally.
+            try {
+                handle->pending.push_back(hash_code);
+            } catch (...) {
+                return;
+            }
+
+            if (handle->busy == 0) handle->evict_pending();
+        }
+    };
+
+    std::shared_ptr<eviction_handle> evictor_;
+
+    // Marks the table busy for its lifetime, so that eviction doesn't
+    // modify the table in the middle of another modification. Evictions
+    // that wait on it happen when the table is no longer busy.
+    class busy_scope
+    {
+    public:
+        explicit busy_scope(const rh_weak_hash_table& table)
+                : handle_(table.evictor_.get())
+        {
+            if (handle_) ++handle_->busy;
+        }
+
+        ~busy_scope()
+        {
+            if (handle_) handle_->release();
+        }
+
+        busy_scope(const busy_scope&) = delete;
+        busy_scope& operator=(const busy_scope&) = delete;
+
+    private:
+        eviction_handle* handle_;
+    };
+
+    // Marks the table busy while an iterator lives, since the views it
+    // hands out may drop the last reference to a key, and evicting
+    // would shift buckets out from under it. It shares the handle, as
+    // an iterator may outlive its table.
+    class busy_token
+    {
+    public:
+        busy_token() = default;
+
+        explicit busy_token(std::shared_ptr<eviction_handle> handle)
+                : handle_(std::move(handle))
+        {
+            if (handle_) ++handle_->busy;
+        }
+
+        busy_token(const busy_token& other)
+                : busy_token(other.handle_)
+        { }
+
+        busy_token(busy_token&& other) noexcept
+                : handle_(std::move(other.handle_))
+        { }
+
+        busy_token& operator=(busy_token other) noexcept
+        {
+            std::swap(handle_, other.handle_);
+            return *this;
+        }
+
+        ~busy_token()
+        {
+            if (handle_) handle_->release();
+        }
+
+    private:
+        std::shared_ptr<eviction_handle> handle_;
+    };
+
+    // Marks a live iterator's table busy. end() needn't be, since it
+    // hands out no views.
+    template <class It>
+    It busy_iterator_(It it) const
+    {
+        it.busy_ = busy_token(evictor_);
+        return it;
+    }
+
+    static constexpr size_t npos_ = size_t(-1);
+
+    template <class W, class = void>
+    struct has_inline_key : std::false_type { };
+
+    template <class W>
+    struct has_inline_key<W, std::void_t<decltype(
+            weak_traits<W>::peek_key(std::declval<const W&>()))>>
+        : std::true_type { };
+
+    // Whether keys can be read without locking.
+    static constexpr bool has_inline_key_ =
+            has_inline_key<weak_value_type>::value;
+
+    struct no_probe_hit { };
+
+    // The view that a probe locked to compare keys, if the caller asks
+    // for it, so that a hit takes one lock rather than one to compare
+    // and another to return. Probes of inline keys lock nothing.
+    using probe_hit_ = std::conditional_t<
+            has_inline_key_, no_probe_hit,
+            std::optional<const_view_value_type>>;
+
+    // A view of the element that a probe found in `bucket`, which may
+    // have expired since, unless the probe locked it into `hit`.
+    template <class B>
+    static decltype(auto) hit_view_(B& bucket, probe_hit_& hit)
+    {
+        if constexpr (has_inline_key_) {
+            return bucket.value_.lock();
+        } else {
+            assert(hit);
+            return std::move(*hit);
+        }
+    }
+
+    template <class W, class = void>
+    struct never_expires : std::false_type { };
+
+    template <class W>
+    struct never_expires<W, std::enable_if_t<W::never_expires>>
+        : std::true_type { };
+
+    // Whether elements can expire at all. Tables of strong values (see
+    // rh_unordered_set.h) needn't look for expired ones.
+    static constexpr bool can_expire_ = !never_expires<weak_value_type>::value;
+
+    // The part of a strong value that holds its key: the first of a
+    // pair, or else the whole value.
+    template <class S, class = void>
+    struct strong_key_part
+    {
+        using type = S;
+    };
+
+    template <class S>
+    struct strong_key_part<S, std::void_t<typename S::first_type>>
+    {
+        using type = typename S::first_type;
+    };
+
+    // Whether elements hold their keys weakly, through the same kind of
+    // pointer that make_evicting returns, as in weak sets and weak-keyed
+    // maps. Only then can the death of a key expire its element.
+    static constexpr bool has_weak_keys_ = can_expire_ && std::is_same_v<
+            typename strong_key_part<strong_value_type>::type,
+            std::shared_ptr<const std::remove_const_t<key_type>>>;
+
+    template <class W, class = void>
+    struct has_retain : std::false_type { };
+
+    template <class W>
+    struct has_retain<W, std::void_t<decltype(weak_traits<W>::retain(
+            std::declval<const typename weak_traits<W>::view_type&>()))>>
+        : std::true_type { };
+
+    template <class W, bool = has_retain<W>::value>
+    struct retained_value
+    {
+        using type = typename weak_traits<W>::strong_type;
+    };
+
+    template <class W>
+    struct retained_value<W, true>
+    {
+        using type = decltype(weak_traits<W>::retain(
+                std::declval<const typename weak_traits<W>::view_type&>()));
+    };
+
+    // What the retention window holds for each element.
+    using retained_type_ = typename retained_value<weak_value_type>::type;
+    using retained_vector_t = std::vector<retained_type_>;
+
+    // The retention window, overwritten oldest first from retain_pos_.
+    // last_retained_hash_ keeps a run of hits on one element from taking
+    // more than one slot.
+    retained_vector_t retained_;
+    size_t retain_pos_ = 0;
+    size_t last_retained_hash_ = 0;
+
+    // Puts the element of a live view or strong value in the retention
+    // window. Callers are busy, so the reference this drops can't evict
+    // anything until they're done.
+    template <class View>
+    void retain_(size_t hash_code, const View& view)
+    {
+        if constexpr (can_expire_) {
+            if (retained_.empty() || hash_code == last_retained_hash_)
+                return;
+
+            if constexpr (has_retain<weak_value_type>::value)
+                retained_[retain_pos_] = weak_trait::retain(view);
+            else
+                retained_[retain_pos_] = strong_value_type(view);
+
+            if (++retain_pos_ == retained_.size()) retain_pos_ = 0;
+            last_retained_hash_ = hash_code;
+        }
+    }
+
+    void retain_bucket_(Bucket& bucket, size_t hash_code, probe_hit_& hit)
+    {
+        if (retained_.empty()) return;
+
+        auto&& view = hit_view_(bucket, hit);
+        if (weak_trait::key(view)) retain_(hash_code, view);
+    }
+
+    // How many elements ahead batch operations prefetch.
+    static constexpr size_t prefetch_distance = 8;
+
+    // Starts loading the control bytes and the first bucket that a
+    // probe for `hash_code` will look at.
+    void prefetch_(size_t hash_code) const
+    {
+#if defined(__GNUC__)
+        if (bucket_count() == 0) return;
+        size_t pos = which_bucket_(hash_code);
+        __builtin_prefetch(&ctrl_[pos]);
+        __builtin_prefetch(&buckets_[pos]);
+#else
+        (void) hash_code;
+#endif
+    }
+
+    // The occupied buckets come from match_full, a bit per bucket, so a
+    // sparse table is mostly skipped a group at a time. The last group
+    // may run into the mirrored control bytes, which don't count.
+    template <class Buckets, class F>
+    static void for_each_live_in_(Buckets& buckets, const ctrl_vector_t& ctrl,
+                                  F& f)
+    {
+        for (size_t base = 0; base < buckets.size();
+                base += probe_group::width) {
+            for (size_t i : probe_group(&ctrl[base]).match_full()) {
+                if (base + i >= buckets.size()) break;
+
+                auto&& view = buckets[base + i].value_.lock();
+                if (weak_trait::key(view)) f(view);
+            }
+        }
+    }
+
+    // Takes on the settings of `other`, for the copy constructors, once
+    // the elements are in. The retention window starts out empty.
+    void copy_settings_(const rh_weak_hash_table& other)
+    {
+        rehash_step_ = other.rehash_step_;
+        sweep_step_ = other.sweep_step_;
+        shrink_at_ratio_ = other.shrink_at_ratio_;
+
+        reserved_ = other.reserved_;
+        if (reserved_ > bucket_count()) rehash(reserved_);
+
+        set_retention_window(other.retention_window());
+    }
+
+    // Does the upkeep that follows each insertion.
+    void after_insert_()
+    {
+        sweep_some_(sweep_step_);
+        maybe_grow_();
+        rehash_some_(rehash_step_);
+        maybe_shrink_();
+    }
+
+    // Grows if the table is too full, or would be after `incoming` more
+    // insertions.
+    void maybe_grow_(size_t incoming = 0)
+    {
+        auto cap = bucket_count();
+        if (double(size_ + incoming)/double(cap) <= grow_at_ratio) return;
+
+        if (rehash_step_ == 0) {
+            // Don't grow because of expired elements. The sweep costs
+            // about what the resize it may save would. Unless it frees
+            // half the table, grow anyway, so that a table of live
+            // elements isn't swept again on the next insertion.
+            if (can_expire_) {
+                remove_expired_();
+                if (double(size_ + incoming)/double(cap) <= grow_at_ratio / 2) return;
+            }
+            resize_(2 * cap);
+        } else {
+            // A full sweep would stall just like the resize we're
+            // spreading out, so only the incremental sweep applies.
+            start_rehash_(2 * cap);
+        }
+    }
+
+    // Erases the expired elements with the given hash code, which
+    // includes any whose key just died. Only eviction_handle calls this,
+    // with the table marked busy. It never resizes: shrinking waits for
+    // the next insertion or erasure.
+    void evict_(size_t hash_code)
+    {
+        if (bucket_count() != 0) {
+            size_t pos = which_bucket_(hash_code);
+
+            // As in insert_, elements with this hash code can't be past
+            // the first element that's closer to its preferred bucket.
+            for (size_t dist = 0; used_(pos); ) {
+                Bucket& bucket = buckets_[pos];
+                if (dist > probe_distance_(pos,
+                                           which_bucket_(bucket.hash_code_)))
+                    break;
+
+                // Erasing shifts the next element into pos.
+                if (bucket.hash_code_ == hash_code &&
+                        bucket.value_.expired()) {
+                    erase_at_(pos);
+                } else {
+                    pos = next_bucket_(pos);
+                    ++dist;
+                }
+            }
+        }
+
+        if (rehashing()) {
+            size_t pos = old_size_policy_.home(hash_code);
+            for (size_t probed = 0; probed < old_buckets_.size() &&
+                    old_ctrl_[pos] != ctrl_empty; ++probed) {
+                if (old_ctrl_[pos] >= 0 &&
+                        old_buckets_[pos].hash_code_ == hash_code &&
+                        old_buckets_[pos].value_.expired())
+                    erase_old_(pos);
+                pos = old_size_policy_.wrap(pos + 1);
+            }
+        }
+    }
+
+    // Waits out an incremental rehash, since starting another would
+    // finish this one all at once. Callers check again after each
+    // rehash step, so the table shrinks once the rehash is done.
+    void maybe_shrink_()
+    {
+        if (rehashing()) return;
+
+        auto cap = bucket_count();
+        auto floor = std::max(default_bucket_count, reserved_);
+        if (cap <= floor || double(size_)/double(cap) >= shrink_at_ratio_)
+            return;
+
+        size_t new_bucket_count = std::max(floor, buckets_needed_(2 * size_));
+        if (size_policy::round_up(new_bucket_count) >= cap) return;
+
+        if (rehash_step_ == 0) {
+            resize_(new_bucket_count);
+        } else {
+            start_rehash_(new_bucket_count);
+        }
+    }
+
+    // The least bucket count that holds `count` elements without growing.
+    static size_t buckets_needed_(size_t count)
+    {
+        return size_t(std::ceil(double(count) / grow_at_ratio));
+    }
+
+    void remove_expired_()
+    {
+        finish_rehash_();
+
+        // Erasing shifts the following elements back into pos, so pos
+        // has to be examined again.
+        for (size_t pos = 0; pos < bucket_count(); ) {
+            if (used_(pos) && buckets_[pos].value_.expired()) {
+                erase_at_(pos);
+            } else {
+                ++pos;
+            }
+        }
+    }
+
+    // Tables with fewer buckets than this are resized and swept on one
+    // thread, even when given a pool.
+    static constexpr size_t parallel_threshold_ = size_t(1) << 16;
+
+    // Splits the buckets into runs that each begin with an empty bucket,
+    // so that every cluster lies within one run, and compacts each run
+    // on its own thread. (Erasing with erase_at_ instead would shift
+    // clusters across the boundaries between threads.)
+    void remove_expired_(work_stealing_pool& pool)
+    {
+        finish_rehash_();
+
+        size_t n = bucket_count();
+        if (n < parallel_threshold_ || pool.size() < 2) {
+            remove_expired_();
+            return;
+        }
+
+        size_t parts = 4 * pool.size();
+        size_t chunk = (n + parts - 1) / parts;
+        parts = (n + chunk - 1) / chunk;
+
+        // The first empty bucket at or after the start of each chunk.
+        // The load factor stays below 1, so there always is one.
+        std::vector<size_t> starts(parts);
+        pool.parallel_for(parts, [&](size_t k) {
+            size_t pos = k * chunk;
+            while (used_(pos)) pos = next_bucket_(pos);
+            starts[k] = pos;
+        });
+
+        // A chunk without an empty bucket shares its start with the next.
+        std::vector<size_t> runs;
+        for (size_t start : starts) {
+            if (runs.empty() || start != runs.back()) runs.push_back(start);
+        }
+        if (runs.size() > 1 && runs.back() == runs.front()) runs.pop_back();
+
+        std::vector<size_t> removed(runs.size());
+        pool.parallel_for(runs.size(), [&](size_t k) {
+            size_t start = runs[k];
+            size_t length = runs.size() == 1
+                            ? n
+                            : probe_distance_(runs[(k + 1) % runs.size()],
+                                              start);
+            removed[k] = compact_(start, length);
+        });
+
+        for (size_t each : removed)
+            size_ -= each;
+    }
+
+    // Erases the expired elements of the `length` buckets starting at
+    // `pos`, which must be empty, as must the bucket after them, moving
+    // each live element back as far toward its preferred bucket as it
+    // can go. Leaves size_ alone, returning the number erased.
+    size_t compact_(size_t pos, size_t length)
+    {
+        size_t removed = 0;
+
+        for (size_t i = 0; i < length; ) {
+            if (!used_(pos)) {
+                pos = next_bucket_(pos);
+                ++i;
+                continue;
+            }
+
+            // A cluster begins at pos. Every element in it has its
+            // preferred bucket in it, at cluster offset `offset - dist`.
+            size_t write = pos, write_offset = 0;
+
+            for (size_t offset = 0; used_(pos); ++offset, ++i) {
+                Bucket& bucket = buckets_[pos];
+
+                if (bucket.value_.expired()) {
+                    destroy_bucket_(pos);
+                    ++removed;
+                } else {
+                    size_t home_offset = offset - probe_distance_(
+                            pos, which_bucket_(bucket.hash_code_));
+                    for ( ; write_offset < home_offset; ++write_offset)
+                        write = next_bucket_(write);
+
+                    if (write != pos) move_bucket_(pos, write);
+                    write = next_bucket_(write);
+                    ++write_offset;
+                }
+
+                pos = next_bucket_(pos);
+            }
+        }
+
+        return removed;
+    }
+
+    // Examines the next `count` buckets for expired elements, erasing
+    // them.
+    void sweep_some_(size_t count)
+    {
+        if (!can_expire_ || bucket_count() == 0) return;
+
+        while (count-- > 0) {
+            if (sweep_pos_ >= bucket_count()) sweep_pos_ = 0;
+
+            // Erasing shifts the following elements back into
+            // sweep_pos_, so it has to be examined again.
+            if (used_(sweep_pos_) && buckets_[sweep_pos_].value_.expired()) {
+                erase_at_(sweep_pos_);
+            } else {
+                ++sweep_pos_;
+            }
+        }
+    }
+
+    void resize_(size_t new_bucket_count)
+    {
+        finish_rehash_();
+
+        new_bucket_count = size_policy::round_up(new_bucket_count);
+        assert(size_ == 0 || new_bucket_count > size_);
+
+        using std::swap;
+        vector_t old_buckets(new_bucket_count, bucket_allocator_);
+        ctrl_vector_t old_ctrl(ctrl_size_(new_bucket_count),
+                               ctrl_allocator_type(bucket_allocator_));
+        swap(old_buckets, buckets_);
+        swap(old_ctrl, ctrl_);
+        size_ = 0;
+        size_policy_.reset(new_bucket_count);
+        init_buckets_();
+
+        // Elements are unique, so they can be moved without comparing
+        // keys, and hence without locking.
+        for (size_t pos = 0; pos < old_buckets.size(); ++pos) {
+            if (old_ctrl[pos] != ctrl_empty) {
+                Bucket& bucket = old_buckets[pos];
+                if (!bucket.value_.expired()) {
+                    place_(which_bucket_(bucket.hash_code_), 0,
+                           bucket.hash_code_, std::move(bucket.value_));
+                }
+                destroy_value_(bucket);
+            }
+        }
+    }
+
+    // Resizes in two parallel passes over `parts` ranges of buckets.
+    // First each range of old buckets sorts its live elements by the
+    // range of new buckets that they prefer. Then each range of new
+    // buckets places its elements, setting aside those that would spill
+    // into the next range, which are placed last, on this thread.
+    void resize_(size_t new_bucket_count, work_stealing_pool& pool)
+    {
+        finish_rehash_();
+
+        new_bucket_count = size_policy::round_up(new_bucket_count);
+        if (std::max(bucket_count(), new_bucket_count) < parallel_threshold_
+                || pool.size() < 2) {
+            resize_(new_bucket_count);
+            return;
+        }
+
+        assert(size_ == 0 || new_bucket_count > size_);
+
+        using std::swap;
+        vector_t old_buckets(new_bucket_count, bucket_allocator_);
+        ctrl_vector_t old_ctrl(ctrl_size_(new_bucket_count),
+                               ctrl_allocator_type(bucket_allocator_));
+        swap(old_buckets, buckets_);
+        swap(old_ctrl, ctrl_);
+        size_policy_.reset(new_bucket_count);
+        init_buckets_();
+
+        size_t parts = 4 * pool.size();
+        size_t old_chunk = (old_buckets.size() + parts - 1) / parts;
+        size_t new_chunk = (new_bucket_count + parts - 1) / parts;
+
+        // staging[from * parts + to] holds the positions of the elements
+        // in old range `from` that prefer new range `to`.
+        std::vector<std::vector<size_t>> staging(parts * parts);
+        pool.parallel_for(parts, [&](size_t from) {
+            size_t end = std::min(old_buckets.size(), (from + 1) * old_chunk);
+            for (size_t pos = from * old_chunk; pos < end; ++pos) {
+                if (old_ctrl[pos] == ctrl_empty) continue;
+
+                Bucket& bucket = old_buckets[pos];
+                if (bucket.value_.expired()) {
+                    destroy_value_(bucket);
+                } else {
+                    size_t to = which_bucket_(bucket.hash_code_) / new_chunk;
+                    staging[from * parts + to].push_back(pos);
+                }
+            }
+        });
+
+        std::vector<size_t> placed(parts);
+        std::vector<std::vector<std::pair<size_t, weak_value_type>>>
+                spilled(parts);
+        pool.parallel_for(parts, [&](size_t to) {
+            size_t end = std::min(new_bucket_count, (to + 1) * new_chunk);
+            for (size_t from = 0; from < parts; ++from) {
+                for (size_t pos : staging[from * parts + to]) {
+                    Bucket& bucket = old_buckets[pos];
+                    size_t hash_code = bucket.hash_code_;
+                    weak_value_type value = std::move(bucket.value_);
+                    destroy_value_(bucket);
+                    placed[to] += place_before_(which_bucket_(hash_code),
+                                                hash_code, std::move(value),
+                                                end, spilled[to]);
+                }
+            }
+        });
+
+        size_ = 0;
+        for (size_t each : placed)
+            size_ += each;
+
+        for (auto& each : spilled) {
+            for (auto& [hash_code, value] : each)
+                place_(which_bucket_(hash_code), 0, hash_code,
+                       std::move(value));
+        }
+    }
+
+    // Moves the elements out of the current buckets into new ones, but
+    // only a few at a time; see set_rehash_step.
+    void start_rehash_(size_t new_bucket_count)
+    {
+        finish_rehash_();
+
+        new_bucket_count = size_policy::round_up(new_bucket_count);
+        assert(new_bucket_count > size_);
+
+        using std::swap;
+        swap(old_buckets_, buckets_);
+        swap(old_ctrl_, ctrl_);
+        old_size_policy_ = size_policy_;
+        rehash_pos_ = 0;
+
+        buckets_ = vector_t(new_bucket_count, bucket_allocator_);
+        ctrl_ = ctrl_vector_t(ctrl_size_(new_bucket_count),
+                              ctrl_allocator_type(bucket_allocator_));
+        size_policy_.reset(new_bucket_count);
+        init_buckets_();
+    }
+
+    // Moves the next `count` old buckets into the new ones, freeing the
+    // old buckets once they've all been moved.
+    void rehash_some_(size_t count)
+    {
+        if (!rehashing()) return;
+
+        size_t stop = std::min(old_buckets_.size(), rehash_pos_ + count);
+
+        for ( ; rehash_pos_ < stop; ++rehash_pos_) {
+            if (old_ctrl_[rehash_pos_] < 0) continue;
+
+            Bucket& bucket = old_buckets_[rehash_pos_];
+            --size_;
+            if (!bucket.value_.expired()) {
+                place_(which_bucket_(bucket.hash_code_), 0,
+                       bucket.hash_code_, std::move(bucket.value_));
+            }
+            erase_old_value_(rehash_pos_);
+        }
+
+        if (rehash_pos_ == old_buckets_.size()) {
+            old_buckets_.clear();
+            old_ctrl_.clear();
+        }
+    }
+
+    void finish_rehash_()
+    {
+        rehash_some_(old_buckets_.size());
+    }
+
+    // Removes the element at `pos` of the old buckets.
+    void erase_old_(size_t pos)
+    {
+        erase_old_value_(pos);
+        --size_;
+    }
+
+    // Destroys the value at `pos` of the old buckets, leaving a
+    // tombstone. (Shifting the cluster back could move elements behind
+    // rehash_pos_, where they'd never be moved.)
+    void erase_old_value_(size_t pos)
+    {
+        destroy_value_(old_buckets_[pos]);
+        for (size_t i = pos; i < old_ctrl_.size(); i += old_buckets_.size())
+            old_ctrl_[i] = ctrl_deleted;
+    }
+
+    // Finds `key` in the new buckets, or, if rehashing, the old.
+    template <class K>
+    const Bucket* lookup_(const K& key, size_t hash_code) const
+    {
+        size_t pos = lookup_in_(buckets_, ctrl_, size_policy_,
+                                key, hash_code);
+        if (pos != npos_) return &buckets_[pos];
+
+        if (rehashing()) {
+            pos = lookup_in_(old_buckets_, old_ctrl_, old_size_policy_,
+                             key, hash_code);
+            if (pos != npos_) return &old_buckets_[pos];
+        }
+
+        return nullptr;
+    }
+
+    // Finds the position of `key` in the given buckets, or npos_.
+    //
+    // Scans the control bytes a group at a time, looking at buckets only
+    // where the hash fragment matches, until the group that ends the
+    // cluster.
+    template <class K>
+    size_t lookup_in_(const vector_t& buckets,
+                      const ctrl_vector_t& ctrl,
+                      const size_policy& policy,
+                      const K& key,
+                      size_t hash_code,
+                      probe_hit_* hit = nullptr) const
+    {
+        if (buckets.size() == 0) return npos_;
+
+        ctrl_t fragment = fragment_(hash_code);
+        size_t pos = policy.home(hash_code);
+
+        for (size_t probed = 0; probed < buckets.size();
+                probed += probe_group::width) {
+            probe_group group(&ctrl[pos]);
+            group_mask empty = group.match_empty();
+
+            for (size_t i : group.match(fragment).before_first(empty)) {
+                size_t found = policy.wrap(pos + i);
+                const Bucket& bucket = buckets[found];
+                if (hash_code == bucket.hash_code_ &&
+                        holds_key_(bucket, key, hit)) {
+                    // Keys are unique, so if it's expired, it's gone.
+                    if (has_inline_key_ && bucket.value_.expired())
+                        return npos_;
+                    return found;
+                }
+            }
+
+            if (empty) return npos_;
+
+            pos = policy.wrap(pos + probe_group::width);
+        }
+
+        return npos_;
+    }
+
+    // Whether `bucket` holds `key`. Compares the key in place if the weak
+    // value stores it inline; otherwise locks the bucket, in which case
+    // an expired bucket holds no key, and on a match hands the locked
+    // view back through `hit`, if given. Callers compare hash codes
+    // first, so this normally runs only on the bucket that matches.
+    template <class K>
+    bool holds_key_(const Bucket& bucket, const K& key,
+                    probe_hit_* hit) const
+    {
+        if constexpr (has_inline_key_) {
+            (void) hit;
+            return equal_(*weak_trait::peek_key(bucket.value_), key);
+        } else {
+            auto locked = bucket.value_.lock();
+            const auto* bucket_key = weak_trait::key(locked);
+            if (!bucket_key || !equal_(*bucket_key, key)) return false;
+
+            if (hit) hit->emplace(std::move(locked));
+            return true;
+        }
+    }
+
+    // Based on https://www.sebastiansylvan.com/post/robin-hood-hashing-should-be-your-default-hash-table-implementation/
+    void insert_(size_t hash_code, strong_value_type value)
+    {
+        const key_type& key = *weak_trait::key(value);
+
+        // The key may still be in the old buckets, but we replace it in
+        // the new ones.
+        if (rehashing()) {
+            size_t old_pos = lookup_in_(old_buckets_, old_ctrl_,
+                                        old_size_policy_, key, hash_code);
+            if (old_pos != npos_) erase_old_(old_pos);
+        }
+
+        size_t pos, dist;
+
+        // If it matches the value to insert, replace.
+        if (probe_(key, hash_code, pos, dist)) {
+            buckets_[pos].value_ = std::move(value);
+            return;
+        }
+
+        place_(pos, dist, hash_code, weak_value_type(std::move(value)));
+    }
+
+    // Looks for the key in the new buckets until reaching the bucket
+    // where it would be. Returns whether it's found, setting `pos` to
+    // its bucket if so, or else to the bucket where it belongs, at probe
+    // distance `dist`.
+    template <class K>
+    bool probe_(const K& key, size_t hash_code,
+                size_t& pos, size_t& dist,
+                probe_hit_* hit = nullptr) const
+    {
+        pos = which_bucket_(hash_code);
+        dist = 0;
+
+        for (;;) {
+            const Bucket& bucket = buckets_[pos];
+
+            if (!used_(pos))
+                return false;
+
+            if (hash_code == bucket.hash_code_ &&
+                    holds_key_(bucket, key, hit))
+                return true;
+
+            if (dist > probe_distance_(pos, which_bucket_(bucket.hash_code_)))
+                return false;
+
+            pos = next_bucket_(pos);
+            ++dist;
+        }
+    }
+
+    // Puts an element that isn't in the table yet into bucket `pos`, at
+    // probe distance `dist`, displacing richer elements toward the end of
+    // the cluster. Moves only weak values, so nothing gets locked.
+    // Returns the bucket where the new element ends up.
+    size_t place_(size_t pos, size_t dist, size_t hash_code,
+                  weak_value_type value)
+    {
+        size_t placed = npos_;
+
+        for (;;) {
+            Bucket& bucket = buckets_[pos];
+
+            // If the bucket is unoccupied, use it:
+            if (!used_(pos)) {
+                std::allocator_traits<weak_value_allocator_type>::construct(
+                        weak_value_allocator_,
+                        &bucket.value_,
+                        std::move(value));
+                bucket.hash_code_ = hash_code;
+                set_ctrl_(pos, fragment_(hash_code));
+                ++size_;
+                return placed == npos_ ? pos : placed;
+            }
+
+            // Otherwise, we check the probe distance.
+            size_t existing_distance =
+                probe_distance_(pos, which_bucket_(bucket.hash_code_));
+            if (dist > existing_distance) {
+                // An expired bucket that we would displace anyway can
+                // just be overwritten. (Reusing one that we wouldn't
+                // displace would break the invariant that lookup_
+                // relies on.)
+                if (bucket.value_.expired()) {
+                    bucket.value_ = std::move(value);
+                    bucket.hash_code_ = hash_code;
+                    set_ctrl_(pos, fragment_(hash_code));
+                    return placed == npos_ ? pos : placed;
+                }
+
+                if (placed == npos_) placed = pos;
+
+                using std::swap;
+                swap(value, bucket.value_);
+                swap(hash_code, bucket.hash_code_);
+                set_ctrl_(pos, fragment_(bucket.hash_code_));
+                dist = existing_distance;
+            }
+
+            pos = next_bucket_(pos);
+            ++dist;
+        }
+    }
+
+    // Like place_, starting at probe distance 0, but for placing elements
+    // in parallel: stays within the buckets before `end`, appending to
+    // `spilled` whichever element would have to go past it. Leaves size_
+    // alone, returning whether it used up an empty bucket.
+    bool place_before_(size_t pos, size_t hash_code, weak_value_type value,
+                       size_t end,
+                       std::vector<std::pair<size_t, weak_value_type>>&
+                               spilled)
+    {
+        for (size_t dist = 0; ; ++dist) {
+            Bucket& bucket = buckets_[pos];
+
+            if (!used_(pos)) {
+                std::allocator_traits<weak_value_allocator_type>::construct(
+                        weak_value_allocator_,
+                        &bucket.value_,
+                        std::move(value));
+                bucket.hash_code_ = hash_code;
+                set_ctrl_(pos, fragment_(hash_code));
+                return true;
+            }
+
+            size_t existing_distance =
+                probe_distance_(pos, which_bucket_(bucket.hash_code_));
+            if (dist > existing_distance) {
+                using std::swap;
+                swap(value, bucket.value_);
+                swap(hash_code, bucket.hash_code_);
+                set_ctrl_(pos, fragment_(bucket.hash_code_));
+                dist = existing_distance;
+            }
+
+            if (pos + 1 == end) {
+                spilled.emplace_back(hash_code, std::move(value));
+                return false;
+            }
+
+            pos = next_bucket_(pos);
+        }
+    }
+
+    // Robin Hood backward-shift deletion: rather than leave a hole, which
+    // would end lookups early, shift the rest of the cluster back one
+    // bucket, until reaching an empty bucket or an element that is
+    // already in its preferred bucket.
+    void erase_at_(size_t pos)
+    {
+        destroy_bucket_(pos);
+        --size_;
+
+        for (;;) {
+            size_t next = next_bucket_(pos);
+            Bucket& bucket = buckets_[next];
+
+            if (!used_(next) ||
+                    probe_distance_(next, which_bucket_(bucket.hash_code_)) == 0)
+                return;
+
+            move_bucket_(next, pos);
+            pos = next;
+        }
+    }
+
+    // Moves the element of bucket `from` into the unused bucket `to`.
+    void move_bucket_(size_t from, size_t to)
+    {
+        std::allocator_traits<weak_value_allocator_type>::construct(
+                weak_value_allocator_,
+                &buckets_[to].value_,
+                std::move(buckets_[from].value_));
+        buckets_[to].hash_code_ = buckets_[from].hash_code_;
+        set_ctrl_(to, ctrl_[from]);
+        destroy_bucket_(from);
+    }
+
+    void destroy_bucket_(size_t pos)
+    {
+        destroy_value_(buckets_[pos]);
+        set_ctrl_(pos, ctrl_empty);
+    }
+
+    void destroy_value_(Bucket& bucket)
+    {
+        std::allocator_traits<weak_value_allocator_type>::destroy(
+            weak_value_allocator_,
+            &bucket.value_);
+    }
+
+    void init_buckets_()
+    {
+        for (auto& ctrl : ctrl_)
+            ctrl = ctrl_empty;
+    }
+
+    bool used_(size_t pos) const
+    {
+        return ctrl_[pos] != ctrl_empty;
+    }
+
+    // Sets the control byte for bucket pos. The control array has
+    // probe_group::width - 1 extra bytes at the end, mirroring the first
+    // ones, so that a group load starting near the end sees the buckets
+    // that the probe wraps around to.
+    void set_ctrl_(size_t pos, ctrl_t ctrl)
+    {
+        for (size_t i = pos; i < ctrl_.size(); i += bucket_count())
+            ctrl_[i] = ctrl;
+    }
+
+    static size_t ctrl_size_(size_t bucket_count)
+    {
+        return bucket_count == 0 ? 0 : bucket_count + probe_group::width - 1;
+    }
+
+    // The 7-bit fragment of the hash code that goes in the control byte.
+    // Takes the high bits of a multiplicative hash, so that it's
+    // independent of the bits that choose the bucket.
+    static ctrl_t fragment_(size_t hash_code)
+    {
+        return ctrl_t((hash_code * size_t(0x9E3779B97F4A7C15))
+                      >> (sizeof(size_t) * CHAR_BIT - 7));
+    }
+
+    size_t next_bucket_(size_t pos) const
+    {
+        return size_policy_.wrap(pos + 1);
+    }
+
+    size_t probe_distance_(size_t actual, size_t preferred) const
+    {
+        return size_policy_.distance(actual, preferred);
+    }
+
+    size_t which_bucket_(size_t hash_code) const
+    {
+        return size_policy_.home(hash_code);
+    }
+};
+
+template <
+    class T,
+    class Hash,
+    class KeyEqual,
+    class Allocator,
+    class SizePolicy
+>
+class rh_weak_hash_table<T, Hash, KeyEqual, Allocator, SizePolicy>::iterator
+        : public std::iterator<std::forward_iterator_tag, T>
+{
+public:
+    using base_t = typename vector_t::iterator;
+
+    /// Iterates over [start, limit) and then, if given,
+    /// [next_start, next_limit).
+    iterator(base_t start, base_t limit, const ctrl_t* ctrl,
+          base_t next_start, base_t next_limit, const ctrl_t* next_ctrl)
+            : base_(start), limit_(limit), ctrl_(ctrl)
+            , next_base_(next_start), next_limit_(next_limit)
+            , next_ctrl_(next_ctrl)
+    {
+        find_next_();
+    }
+
+    iterator(base_t start, base_t limit, const ctrl_t* ctrl)
+            : iterator(start, limit, ctrl, limit, limit, nullptr)
+    { }
+
+    view_value_type operator*() const
+    {
+        return base_->value_.lock();
+    }
+
+    iterator& operator++()
+    {
+        advance_();
+        return *this;
+    }
+
+    iterator operator++(int)
+    {
+        auto old = *this;
+        ++*this;
+        return old;
+    }
+
+    bool operator==(iterator other) const
+    {
+        return base_ == other.base_;
+    }
+
+    bool operator!=(iterator other) const
+    {
+        return base_ != other.base_;
+    }
+
+private:
+    // Invariant: if base_ != limit_ then base_ is used and not expired,
+    // and ctrl_ points to its control byte. Once base_ reaches limit_,
+    // the iterator moves on to the next range, if any.
+    base_t base_;
+    base_t limit_;
+    const ctrl_t* ctrl_;
+    base_t next_base_;
+    base_t next_limit_;
+    const ctrl_t* next_ctrl_;
+    busy_token busy_;
+
+    void find_next_()
+    {
+        for (;;) {
+            while (base_ != limit_ &&
+                    (*ctrl_ < 0 || base_->value_.expired())) {
+                ++base_;
+                ++ctrl_;
+            }
+
+            if (base_ != limit_ || limit_ == next_limit_) return;
+
+            base_ = next_base_;
+            limit_ = next_limit_;
+            ctrl_ = next_ctrl_;
+        }
+    }
+
+    void advance_()
     {
         ++base_;
+        ++ctrl_;
+        find_next_();
+    }
+
+    friend class rh_weak_hash_table;
+    friend class const_iterator;
+};
+
+template <
+    class T,
+    class Hash,
+    class KeyEqual,
+    class Allocator,
+    class SizePolicy
+>
+class rh_weak_hash_table<T, Hash, KeyEqual, Allocator, SizePolicy>::const_iterator
+        : public std::iterator<std::forward_iterator_tag, const T>
+{
+public:
+    using base_t = typename vector_t::const_iterator;
+
+    /// Iterates over [start, limit) and then, if given,
+    /// [next_start, next_limit).
+    const_iterator(base_t start, base_t limit, const ctrl_t* ctrl,
+          base_t next_start, base_t next_limit, const ctrl_t* next_ctrl)
+            : base_(start), limit_(limit), ctrl_(ctrl)
+            , next_base_(next_start), next_limit_(next_limit)
+            , next_ctrl_(next_ctrl)
+    {
         find_next_();
+    }
+
+    const_iterator(base_t start, base_t limit, const ctrl_t* ctrl)
+            : const_iterator(start, limit, ctrl, limit, limit, nullptr)
+    { }
+
+    const_iterator(iterator other)
+            : base_(other.base_), limit_(other.limit_), ctrl_(other.ctrl_)
+            , next_base_(other.next_base_), next_limit_(other.next_limit_)
+            , next_ctrl_(other.next_ctrl_), busy_(std::move(other.busy_))
+    { }
+
+    const_view_value_type operator*() const
+    {
+        return base_->value_.lock();
+    }
+
+    const_iterator& operator++()
+    {
+        advance_();
         return *this;
     }
 
@@ -908,31 +2446,57 @@ public:
         return old;
     }
 
-    bool operator==(const_iterator other)
+    bool operator==(const_iterator other) const
     {
         return base_ == other.base_;
     }
 
-    bool operator!=(const_iterator other)
+    bool operator!=(const_iterator other) const
     {
         return base_ != other.base_;
     }
 
 private:
-    // Invariant: if base_ != limit_ then base_->occupied();
+    // Invariant: if base_ != limit_ then base_ is used and not expired,
+    // and ctrl_ points to its control byte. Once base_ reaches limit_,
+    // the iterator moves on to the next range, if any.
     base_t base_;
     base_t limit_;
+    const ctrl_t* ctrl_;
+    base_t next_base_;
+    base_t next_limit_;
+    const ctrl_t* next_ctrl_;
+    busy_token busy_;
 
     void find_next_()
     {
-        while (base_ != limit_ && !base_->occupied())
-            ++base_;
+        for (;;) {
+            while (base_ != limit_ &&
+                    (*ctrl_ < 0 || base_->value_.expired())) {
+                ++base_;
+                ++ctrl_;
+            }
+
+            if (base_ != limit_ || limit_ == next_limit_) return;
+
+            base_ = next_base_;
+            limit_ = next_limit_;
+            ctrl_ = next_ctrl_;
+        }
+    }
+
+    void advance_()
+    {
+        ++base_;
+        ++ctrl_;
+        find_next_();
     }
 };
 
-template <class T, class Hash, class KeyEqual, class Allocator>
-void swap(rh_weak_hash_table<T, Hash, KeyEqual, Allocator>& a,
-          rh_weak_hash_table<T, Hash, KeyEqual, Allocator>& b)
+template <class T, class Hash, class KeyEqual, class Allocator,
+          class SizePolicy>
+void swap(rh_weak_hash_table<T, Hash, KeyEqual, Allocator, SizePolicy>& a,
+          rh_weak_hash_table<T, Hash, KeyEqual, Allocator, SizePolicy>& b)
 {
     a.swap(b);
 }
@@ -941,21 +2505,35 @@ template <
     class Key,
     class Hash = std::hash<Key>,
     class KeyEqual = std::equal_to<Key>,
-    class Allocator = std::allocator<Key>
+    class Allocator = std::allocator<Key>,
+    class SizePolicy = power_of_two_sizing
 >
 class weak_unordered_set :
     public rh_weak_hash_table<std::weak_ptr<const Key>,
-                              Hash, KeyEqual, Allocator>
+                              Hash, KeyEqual, Allocator, SizePolicy>
 {
     using BaseClass = rh_weak_hash_table<std::weak_ptr<const Key>,
-                                         Hash, KeyEqual, Allocator>;
+                                         Hash, KeyEqual, Allocator,
+                                         SizePolicy>;
 public:
     using BaseClass::rh_weak_hash_table;
+
+    /// Returns the element equal to `Key(args...)`, inserting a new one
+    /// if there is none. Allocates only when inserting.
+    template <class... Args>
+    std::shared_ptr<const Key> try_emplace(Args&&... args)
+    {
+        Key key(std::forward<Args>(args)...);
+        return this->find_or_insert(key, [&] {
+            return std::make_shared<const Key>(std::move(key));
+        });
+    }
 };
 
-template <class Key, class Hash, class KeyEqual, class Allocator>
-void swap(weak_unordered_set<Key, Hash, KeyEqual, Allocator>& a,
-          weak_unordered_set<Key, Hash, KeyEqual, Allocator>& b)
+template <class Key, class Hash, class KeyEqual, class Allocator,
+          class SizePolicy>
+void swap(weak_unordered_set<Key, Hash, KeyEqual, Allocator, SizePolicy>& a,
+          weak_unordered_set<Key, Hash, KeyEqual, Allocator, SizePolicy>& b)
 {
     a.swap(b);
 }
@@ -964,12 +2542,15 @@ template <
     class KeyValue,
     class Hash,
     class KeyEqual,
-    class Allocator
+    class Allocator,
+    class SizePolicy
     >
 class weak_unordered_map_base
-    : public rh_weak_hash_table<KeyValue, Hash, KeyEqual, Allocator>
+    : public rh_weak_hash_table<KeyValue, Hash, KeyEqual, Allocator,
+                                SizePolicy>
 {
-    using BaseClass = rh_weak_hash_table<KeyValue, Hash, KeyEqual, Allocator>;
+    using BaseClass = rh_weak_hash_table<KeyValue, Hash, KeyEqual, Allocator,
+                                         SizePolicy>;
 public:
     using BaseClass::rh_weak_hash_table;
 };
@@ -977,20 +2558,36 @@ public:
 template <class Key, class Value,
           class Hash = std::hash<Key>,
           class KeyEqual = std::equal_to<Key>,
-          class Allocator = std::allocator<weak_pair<Key, Value>>>
+          class Allocator = std::allocator<weak_pair<Key, Value>>,
+          class SizePolicy = power_of_two_sizing>
 class weak_unordered_map
     : public weak_unordered_map_base<weak_pair<Key, Value>,
-                                     Hash, KeyEqual, Allocator>
+                                     Hash, KeyEqual, Allocator, SizePolicy>
 {
     using BaseClass = weak_unordered_map_base<weak_pair<Key, Value>,
-                                              Hash, KeyEqual, Allocator>;
+                                              Hash, KeyEqual, Allocator,
+                                              SizePolicy>;
 public:
     using BaseClass::weak_unordered_map_base;
+
+    /// Returns the entry for `key`, inserting one with the value made
+    /// from `args` if there is none. The value is made only when
+    /// inserting.
+    template <class... Args>
+    typename BaseClass::strong_value_type
+    try_emplace(const std::shared_ptr<const Key>& key, Args&&... args)
+    {
+        return this->find_or_insert(*key, [&] {
+            return typename BaseClass::strong_value_type(
+                    key, std::make_shared<Value>(std::forward<Args>(args)...));
+        });
+    }
 };
 
-template <class Key, class Value, class Hash, class KeyEqual, class Allocator>
-void swap(weak_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& a,
-          weak_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& b)
+template <class Key, class Value, class Hash, class KeyEqual, class Allocator,
+          class SizePolicy>
+void swap(weak_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& a,
+          weak_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& b)
 {
     a.swap(b);
 }
@@ -998,21 +2595,36 @@ void swap(weak_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& a,
 template <class Key, class Value,
           class Hash = std::hash<Key>,
           class KeyEqual = std::equal_to<Key>,
-          class Allocator = std::allocator<weak_key_pair<Key, Value>>>
+          class Allocator = std::allocator<weak_key_pair<Key, Value>>,
+          class SizePolicy = power_of_two_sizing>
 class weak_key_unordered_map
     : public weak_unordered_map_base<weak_key_pair<Key, Value>,
-                                     Hash, KeyEqual, Allocator>
+                                     Hash, KeyEqual, Allocator, SizePolicy>
 {
     using BaseClass = weak_unordered_map_base<weak_key_pair<Key, Value>,
                                               Hash, KeyEqual,
-                                              Allocator>;
+                                              Allocator, SizePolicy>;
 public:
     using BaseClass::weak_unordered_map_base;
+
+    /// Returns the entry for `key`, inserting one with the value made
+    /// from `args` if there is none. The value is made only when
+    /// inserting.
+    template <class... Args>
+    typename BaseClass::strong_value_type
+    try_emplace(const std::shared_ptr<const Key>& key, Args&&... args)
+    {
+        return this->find_or_insert(*key, [&] {
+            return typename BaseClass::strong_value_type(
+                    key, Value(std::forward<Args>(args)...));
+        });
+    }
 };
 
-template <class Key, class Value, class Hash, class KeyEqual, class Allocator>
-void swap(weak_key_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& a,
-          weak_key_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& b)
+template <class Key, class Value, class Hash, class KeyEqual, class Allocator,
+          class SizePolicy>
+void swap(weak_key_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& a,
+          weak_key_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& b)
 {
     a.swap(b);
 }
@@ -1020,21 +2632,36 @@ void swap(weak_key_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& a,
 template <class Key, class Value,
           class Hash = std::hash<Key>,
           class KeyEqual = std::equal_to<Key>,
-          class Allocator = std::allocator<weak_value_pair<Key, Value>>>
+          class Allocator = std::allocator<weak_value_pair<Key, Value>>,
+          class SizePolicy = power_of_two_sizing>
 class weak_value_unordered_map
     : public weak_unordered_map_base<weak_value_pair<Key, Value>,
-                                     Hash, KeyEqual, Allocator>
+                                     Hash, KeyEqual, Allocator, SizePolicy>
 {
     using BaseClass = weak_unordered_map_base<weak_value_pair<Key, Value>,
                                               Hash, KeyEqual,
-                                              Allocator>;
+                                              Allocator, SizePolicy>;
 public:
     using BaseClass::weak_unordered_map_base;
+
+    /// Returns the entry for `key`, inserting one with the value made
+    /// from `args` if there is none. The value is made only when
+    /// inserting.
+    template <class... Args>
+    typename BaseClass::strong_value_type
+    try_emplace(const Key& key, Args&&... args)
+    {
+        return this->find_or_insert(key, [&] {
+            return typename BaseClass::strong_value_type(
+                    key, std::make_shared<Value>(std::forward<Args>(args)...));
+        });
+    }
 };
 
-template <class Key, class Value, class Hash, class KeyEqual, class Allocator>
-void swap(weak_value_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& a,
-          weak_value_unordered_map<Key, Value, Hash, KeyEqual, Allocator>& b)
+template <class Key, class Value, class Hash, class KeyEqual, class Allocator,
+          class SizePolicy>
+void swap(weak_value_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& a,
+          weak_value_unordered_map<Key, Value, Hash, KeyEqual, Allocator, SizePolicy>& b)
 {
     a.swap(b);
 }
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace intersections::util {
+
+/// A fixed set of worker threads, each with its own task deque. Workers
+/// run their own tasks newest-first and, when they run out, steal the
+/// oldest tasks of other workers.
+class work_stealing_pool
+{
+public:
+    using task_t = std::function<void()>;
+
+    explicit work_stealing_pool(
+            size_t thread_count = std::thread::hardware_concurrency())
+    {
+        if (thread_count == 0) thread_count = 1;
+
+        for (size_t i = 0; i < thread_count; ++i)
+            queues_.push_back(std::make_unique<worker_queue>());
+
+        for (size_t i = 0; i < thread_count; ++i)
+            threads_.emplace_back([this, i] { run_worker_(i); });
+    }
+
+    ~work_stealing_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+
+        work_cv_.notify_all();
+
+        for (auto& thread : threads_)
+            thread.join();
+    }
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    /// The number of worker threads.
+    size_t size() const
+    {
+        return threads_.size();
+    }
+
+    /// Queues a task. Tasks submitted by a worker go on that worker's own
+    /// deque; others are dealt out round-robin.
+    void submit(task_t task)
+    {
+        size_t index = current_worker_ == this
+                       ? current_index_
+                       : next_queue_++ % queues_.size();
+
+        ++pending_;
+
+        {
+            auto& queue = *queues_[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+            ++queued_;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+        }
+
+        work_cv_.notify_one();
+    }
+
+    /// Blocks until every submitted task has finished, then rethrows the
+    /// first exception thrown by any of them. Must not be called from a
+    /// worker.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this] { return pending_ == 0; });
+
+        if (auto error = std::exchange(error_, nullptr))
+            std::rethrow_exception(error);
+    }
+
+    /// Runs `body(i)` for every `i` in [0, count), then waits.
+    template <class F>
+    void parallel_for(size_t count, F body)
+    {
+        for (size_t i = 0; i < count; ++i)
+            submit([&body, i] { body(i); });
+
+        wait();
+    }
+
+private:
+    struct worker_queue
+    {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::exception_ptr error_;
+    bool stopping_ = false;
+
+    std::atomic<size_t> pending_{0};
+
+    // The number of tasks in the deques. It changes only under the lock
+    // of the deque that gains or loses the task, so a worker can't take
+    // a task before it's counted and wrap the count around.
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> next_queue_{0};
+
+    static inline thread_local work_stealing_pool* current_worker_ = nullptr;
+    static inline thread_local size_t current_index_ = 0;
+
+    void run_worker_(size_t index)
+    {
+        current_worker_ = this;
+        current_index_ = index;
+
+        for (;;) {
+            task_t task;
+
+            if (pop_(index, task) || steal_(index, task)) {
+                run_(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_cv_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+            if (stopping_ && queued_ == 0) return;
+        }
+    }
+
+    bool pop_(size_t index, task_t& task)
+    {
+        auto& queue = *queues_[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        --queued_;
+        return true;
+    }
+
+    bool steal_(size_t thief, task_t& task)
+    {
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            auto& queue = *queues_[(thief + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            --queued_;
+            return true;
+        }
+
+        return false;
+    }
+
+    void run_(task_t& task)
+    {
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_) error_ = std::current_exception();
+        }
+
+        if (--pending_ == 0) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+            }
+
+            done_cv_.notify_all();
+        }
+    }
+};
+
+} // end namespace intersections::util
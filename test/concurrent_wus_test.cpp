@@ -0,0 +1,219 @@
+#include "util/concurrent_weak_unordered_set.h"
+#include "util/rcu_weak_unordered_set.h"
+#include <catch.hpp>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace intersections::util;
+
+TEST_CASE("concurrent set basics")
+{
+    concurrent_weak_unordered_set<int> set(5);
+    CHECK( set.shard_count() == 8 );
+    CHECK( set.empty() );
+
+    vector<shared_ptr<const int>> holder;
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(make_shared<const int>(i));
+        set.insert(holder.back());
+    }
+
+    CHECK( set.size() == 1000 );
+    CHECK( set.member(500) );
+    CHECK( set.count(999) == 1 );
+    CHECK_FALSE( set.member(1000) );
+
+    CHECK( set.find_or_insert(7, [] { return make_shared<const int>(7); })
+           == holder[7] );
+    CHECK( set.try_emplace(1000) != nullptr );
+    CHECK_FALSE( set.member(1000) );
+
+    CHECK( set.erase(3) );
+    CHECK_FALSE( set.erase(3) );
+    CHECK_FALSE( set.member(3) );
+
+    holder.resize(500);
+    set.remove_expired();
+    CHECK( set.size() == 499 );
+
+    // Each of the 8 shards keeps the last hit on it.
+    set.set_retention_window(8);
+    weak_ptr<const int> kept = set.try_emplace(2000);
+    CHECK_FALSE( kept.expired() );
+    set.set_retention_window(0);
+    CHECK( kept.expired() );
+
+    set.clear();
+    CHECK( set.empty() );
+}
+
+TEST_CASE("small integer keys spread over the shards")
+{
+    concurrent_weak_unordered_set<int> set(8);
+
+    // std::hash<int> is the identity, so these have no high bits.
+    vector<size_t> per_shard(set.shard_count());
+    for (int i = 0; i < 64; ++i)
+        ++per_shard[set.shard_index(hash<int>()(i))];
+
+    for (size_t count : per_shard) CHECK( count > 0 );
+    CHECK( set.shard_index(hash<int>()(0)) != set.shard_index(hash<int>()(1)) );
+}
+
+TEST_CASE("concurrent set agrees across threads")
+{
+    concurrent_weak_unordered_set<int> set(4);
+    set.set_rehash_step(4);
+    set.set_sweep_step(2);
+
+    constexpr int thread_count = 8;
+    constexpr int key_count = 2000;
+    vector<vector<shared_ptr<const int>>> results(thread_count);
+    vector<thread> threads;
+
+    // Every thread interns the same keys, in a different order.
+    for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < key_count; ++i) {
+                int key = (i * 7 + t * 301) % key_count;
+                results[t].push_back(set.try_emplace(key));
+            }
+        });
+    }
+
+    for (auto& each : threads) each.join();
+
+    CHECK( set.size() == key_count );
+
+    // They all got the same element for each key.
+    vector<shared_ptr<const int>> by_key(key_count);
+    size_t mismatches = 0;
+    for (const auto& result : results) {
+        for (const auto& ptr : result) {
+            if (!by_key[*ptr]) by_key[*ptr] = ptr;
+            mismatches += by_key[*ptr] != ptr;
+        }
+    }
+    CHECK( mismatches == 0 );
+}
+
+TEST_CASE("epochs hold back reclamation while anyone reads")
+{
+    auto& domain = epoch_domain::global();
+    domain.reclaim();
+    domain.reclaim();
+    domain.reclaim();
+    REQUIRE( domain.retired_count() == 0 );
+
+    bool freed = false;
+
+    {
+        epoch_guard guard;
+        domain.retire([&] { freed = true; });
+        for (int i = 0; i < 5; ++i) domain.reclaim();
+        CHECK_FALSE( freed );
+    }
+
+    domain.reclaim();
+    domain.reclaim();
+    CHECK( freed );
+    CHECK( domain.retired_count() == 0 );
+}
+
+TEST_CASE("rcu set basics")
+{
+    rcu_weak_unordered_set<int> set;
+    CHECK( set.empty() );
+
+    vector<shared_ptr<const int>> holder;
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(make_shared<const int>(i));
+        set.insert(holder.back());
+    }
+
+    CHECK( set.size() == 1000 );
+    CHECK( set.member(500) );
+    CHECK( set.count(999) == 1 );
+    CHECK_FALSE( set.member(1000) );
+    CHECK( set.find(7) == holder[7] );
+    CHECK( set.find(1000) == nullptr );
+
+    // Inserting an equal element keeps the first.
+    set.insert(make_shared<const int>(7));
+    CHECK( set.find(7) == holder[7] );
+    CHECK( set.try_emplace(7) == holder[7] );
+    CHECK( set.size() == 1000 );
+
+    CHECK( set.erase(3) );
+    CHECK_FALSE( set.erase(3) );
+    CHECK_FALSE( set.member(3) );
+    CHECK( set.size() == 999 );
+
+    // Reinserting after erasing takes a fresh bucket.
+    set.insert(holder[3]);
+    CHECK( set.find(3) == holder[3] );
+
+    holder.resize(500);
+    set.remove_expired();
+    CHECK( set.size() == 500 );
+    CHECK( set.member(3) );
+    CHECK_FALSE( set.member(700) );
+
+    // A key that expired can come back.
+    auto again = set.try_emplace(700);
+    CHECK( *again == 700 );
+    CHECK( set.find(700) == again );
+
+    set.clear();
+    CHECK( set.empty() );
+    CHECK_FALSE( set.member(3) );
+}
+
+TEST_CASE("rcu set readers run alongside writers")
+{
+    rcu_weak_unordered_set<int> set;
+
+    constexpr int key_count = 4000;
+    vector<shared_ptr<const int>> holder;
+    for (int i = 0; i < key_count; ++i)
+        holder.push_back(make_shared<const int>(i));
+
+    // The first half is there from the start, so readers must always
+    // find it, however the writers grow the table.
+    for (int i = 0; i < key_count / 2; ++i)
+        set.insert(holder[i]);
+
+    atomic<bool> done{false};
+    atomic<size_t> misses{0};
+    vector<thread> threads;
+
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            while (!done) {
+                for (int i = t; i < key_count / 2; i += 4)
+                    misses += set.find(i) != holder[i];
+            }
+        });
+    }
+
+    vector<thread> writers;
+    for (int t = 0; t < 2; ++t) {
+        writers.emplace_back([&, t] {
+            for (int i = key_count / 2 + t; i < key_count; i += 2)
+                set.insert(holder[i]);
+        });
+    }
+
+    for (auto& each : writers) each.join();
+    done = true;
+    for (auto& each : threads) each.join();
+
+    CHECK( misses == 0 );
+    CHECK( set.size() == key_count );
+    for (int i = 0; i < key_count; ++i)
+        misses += set.find(i) != holder[i];
+    CHECK( misses == 0 );
+}
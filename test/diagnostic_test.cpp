@@ -0,0 +1,89 @@
+#include "diagnostic.h"
+#include "util/stringify.h"
+#include <catch.hpp>
+#include <sstream>
+
+using namespace std;
+using namespace intersections;
+
+namespace {
+
+// A type that counts how often it's formatted.
+struct counting_ty : type_impl_base {
+    static inline size_t formatted = 0;
+
+    void format(std::ostream& o) const override
+    {
+        ++formatted;
+        o << "Counted";
+    }
+
+    type_kind kind() const override
+    {
+        return type_kind::Top;
+    }
+
+    size_t hash() const override
+    {
+        return 0xC0FFEE;
+    }
+
+    bool equals(const type_impl_base& other) const override
+    {
+        return dynamic_cast<const counting_ty*>(&other) != nullptr;
+    }
+};
+
+} // end anonymous namespace
+
+TEST_CASE("diagnostics render lazily")
+{
+    auto f = type::make<function_ty>(vector{type::make<int_ty>()},
+                                     type::make<real_ty>());
+    diagnostic d("cannot apply {} to {}", {f, type::make<double_ty>()});
+
+    CHECK( d.str() == "cannot apply (Int) -> Real to Double" );
+    CHECK( stringify(diagnostic("no {} here")) == "no {} here" );
+
+    // Constructing, reporting, deduplicating and rolling back format
+    // nothing; only emitting does, once for each diagnostic kept.
+    auto counted = type::make<counting_ty>();
+    counting_ty::formatted = 0;
+
+    diagnostic_sink sink;
+    CHECK( sink.report({"expected {}", {counted}}) );
+    CHECK_FALSE( sink.report({"expected {}", {counted}}) );
+
+    auto checkpoint = sink.checkpoint();
+    CHECK( sink.report({"overload {} failed", {counted}}) );
+    sink.rollback(checkpoint);
+    CHECK( counting_ty::formatted == 0 );
+
+    ostringstream o;
+    sink.emit(o);
+    CHECK( o.str() == "expected Counted\n" );
+    CHECK( counting_ty::formatted == 1 );
+}
+
+TEST_CASE("diagnostic sink deduplicates and rolls back")
+{
+    auto Int = type::make<int_ty>();
+    auto Real = type::make<real_ty>();
+
+    diagnostic_sink sink;
+    CHECK( sink.report({"expected {}", {Int}}) );
+    CHECK_FALSE( sink.report({"expected {}", {type::make<int_ty>()}}) );
+    CHECK( sink.report({"expected {}", {Real}}) );
+
+    auto before_overloads = sink.checkpoint();
+    CHECK( sink.report({"overload {} failed", {Int}}) );
+    CHECK_FALSE( sink.report({"expected {}", {Real}}) );
+    sink.rollback(before_overloads);
+
+    CHECK( sink.diagnostics().size() == 2 );
+    CHECK( sink.report({"overload {} failed", {Int}}) );
+
+    ostringstream o;
+    sink.emit(o);
+    CHECK( o.str() == "expected Int\nexpected Real\noverload Int failed\n" );
+}
@@ -0,0 +1,72 @@
+#include "util/memoize.h"
+#include <catch.hpp>
+#include <memory>
+#include <string>
+
+using namespace std;
+using namespace intersections::util;
+
+TEST_CASE("memoize on a shared argument")
+{
+    size_t calls = 0;
+    memoize<size_t(shared_ptr<const string>)> length(
+            [&](const shared_ptr<const string>& s) {
+                ++calls;
+                return s->size();
+            });
+
+    auto hello = make_shared<const string>("hello");
+    CHECK( length(hello) == 5 );
+    CHECK( length(hello) == 5 );
+    CHECK( length(make_shared<const string>("hello")) == 5 );
+    CHECK( calls == 1 );
+    CHECK( length.hits() == 2 );
+    CHECK( length.misses() == 1 );
+
+    hello = nullptr;
+    CHECK( length(make_shared<const string>("hello")) == 5 );
+    CHECK( calls == 2 );
+}
+
+TEST_CASE("memoize on a shared result")
+{
+    memoize<shared_ptr<const string>(int)> show(
+            [](int i) { return make_shared<const string>(to_string(i)); });
+
+    auto five = show(5);
+    CHECK( *five == "5" );
+    CHECK( show(5) == five );
+    CHECK( show.misses() == 1 );
+
+    five = nullptr;
+    CHECK( *show(5) == "5" );
+    CHECK( show.misses() == 2 );
+}
+
+TEST_CASE("memoize on a shared argument and result")
+{
+    memoize<shared_ptr<const int>(shared_ptr<const int>)> identity(
+            [](const shared_ptr<const int>& i) { return i; });
+
+    auto seven = make_shared<const int>(7);
+    CHECK( identity(seven) == seven );
+    CHECK( identity(make_shared<const int>(7)) == seven );
+    CHECK( identity.hits() == 1 );
+
+    weak_ptr<const int> weak = seven;
+    seven = nullptr;
+    CHECK( weak.expired() );
+}
+
+TEST_CASE("bounded memoize")
+{
+    vector<shared_ptr<const int>> holder;
+    memoize<int(shared_ptr<const int>)> square(
+            [](const shared_ptr<const int>& i) { return *i * *i; }, 10);
+
+    for (int i = 0; i < 100; ++i) {
+        holder.push_back(make_shared<const int>(i));
+        CHECK( square(holder.back()) == i * i );
+        CHECK( square.size() <= 10 );
+    }
+}
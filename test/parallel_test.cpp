@@ -0,0 +1,57 @@
+#include "parallel_check.h"
+#include "intersections.h"
+#include "util/stringify.h"
+#include <catch.hpp>
+#include <atomic>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace intersections;
+using namespace intersections::util;
+
+TEST_CASE("work-stealing pool runs every task")
+{
+    work_stealing_pool pool(4);
+
+    atomic<size_t> sum{0};
+    pool.parallel_for(1000, [&](size_t i) { sum += i; });
+    CHECK( sum == 999 * 1000 / 2 );
+
+    // Tasks that submit more tasks.
+    atomic<size_t> count{0};
+    for (size_t i = 0; i < 10; ++i) {
+        pool.submit([&] {
+            for (size_t j = 0; j < 10; ++j)
+                pool.submit([&] { ++count; });
+        });
+    }
+    pool.wait();
+    CHECK( count == 100 );
+
+    pool.submit([] { throw runtime_error("oops"); });
+    CHECK_THROWS_AS( pool.wait(), runtime_error );
+}
+
+TEST_CASE("parallel checking merges diagnostics in order")
+{
+    work_stealing_pool pool(4);
+
+    vector<size_t> definitions;
+    for (size_t i = 0; i < 200; ++i) definitions.push_back(i);
+
+    auto diagnostics = check_in_parallel(definitions, [](size_t i) {
+        // Types are interned from every thread at once.
+        vector<type> arguments(i % 5, type::make<int_ty>());
+        auto ty = type::make<function_ty>(arguments, type::make<real_ty>());
+
+        vector<string> result;
+        if (i % 3 == 0) result.push_back(to_string(i) + ": " + stringify(ty));
+        return result;
+    }, pool);
+
+    REQUIRE( diagnostics.size() == 67 );
+    CHECK( diagnostics[0] == "0: () -> Real" );
+    CHECK( diagnostics[1] == "3: (Int, Int, Int) -> Real" );
+    CHECK( diagnostics[66] == "198: (Int, Int, Int) -> Real" );
+}
@@ -0,0 +1,82 @@
+#include "util/query.h"
+#include <catch.hpp>
+#include <memory>
+#include <string>
+
+using namespace std;
+using namespace intersections::util;
+
+TEST_CASE("derived queries recompute only what changed")
+{
+    query_database db;
+    input_query<string, int> weight(db);
+    weight.set("a", 1);
+    weight.set("b", 2);
+
+    // Sums the weights of the characters of a name.
+    derived_query<string, int> total(db, [&](const shared_ptr<const string>& s) {
+        int sum = 0;
+        for (char c : *s) sum += weight.get(string(1, c));
+        return sum;
+    });
+
+    // Whether the total is even; reads only `total`.
+    derived_query<string, bool> even(db, [&](const shared_ptr<const string>& s) {
+        return total.get(s) % 2 == 0;
+    });
+
+    // Reads only `even`.
+    derived_query<string, string> label(db, [&](const shared_ptr<const string>& s) {
+        return even.get(s)? "even" : "odd";
+    });
+
+    auto ab = make_shared<const string>("ab");
+    auto aa = make_shared<const string>("aa");
+
+    CHECK( total.get(ab) == 3 );
+    CHECK( total.get(aa) == 2 );
+    CHECK( label.get(ab) == "odd" );
+    CHECK( total.computations() == 2 );
+    CHECK( even.computations() == 1 );
+    CHECK( label.computations() == 1 );
+
+    // Nothing changed: no recomputation.
+    weight.set("a", 1);
+    CHECK( label.get(ab) == "odd" );
+    CHECK( total.get(aa) == 2 );
+    CHECK( total.computations() == 2 );
+    CHECK( even.computations() == 1 );
+
+    // b changes: only "ab" depends on it. The parity of its total doesn't
+    // change, so `label` needn't be recomputed.
+    weight.set("b", 4);
+    CHECK( total.get(aa) == 2 );
+    CHECK( total.computations() == 2 );
+    CHECK( label.get(ab) == "odd" );
+    CHECK( total.get(ab) == 5 );
+    CHECK( total.computations() == 3 );
+    CHECK( even.computations() == 2 );
+    CHECK( label.computations() == 1 );
+
+    // Now the parity changes.
+    weight.set("b", 5);
+    CHECK( label.get(ab) == "even" );
+    CHECK( label.computations() == 2 );
+}
+
+TEST_CASE("derived query results die with their keys")
+{
+    query_database db;
+    derived_query<int, int> twice(db, [](const shared_ptr<const int>& i) {
+        return 2 * *i;
+    });
+
+    auto five = make_shared<const int>(5);
+    CHECK( twice.get(five) == 10 );
+    CHECK( twice.get(make_shared<const int>(5)) == 10 );
+    CHECK( twice.computations() == 1 );
+
+    five = nullptr;
+    CHECK( twice.get(make_shared<const int>(5)) == 10 );
+    CHECK( twice.computations() == 2 );
+}
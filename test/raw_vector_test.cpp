@@ -43,3 +43,15 @@ TEST_CASE("strings")
     v[0].~string();
     v[1].~string();
 }
+
+TEST_CASE("clear and move assignment")
+{
+    raw_vector<int> v(10);
+    v.clear();
+    CHECK( v.empty() );
+
+    raw_vector<int> w(5);
+    v = std::move(w);
+    CHECK( v.size() == 5 );
+    CHECK( w.empty() );
+}
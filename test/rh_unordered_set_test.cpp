@@ -0,0 +1,120 @@
+#include "util/rh_unordered_set.h"
+#include <catch.hpp>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace intersections::util;
+
+TEST_CASE("strong Robin Hood set")
+{
+    rh_unordered_set<string> set;
+
+    for (int i = 0; i < 1000; ++i)
+        set.insert(to_string(i));
+
+    CHECK( set.size() == 1000 );
+    CHECK( set.member("500") );
+    CHECK_FALSE( set.member("1000") );
+    CHECK( *set.find("42") == "42" );
+
+    // Views are references into the buckets.
+    CHECK( &*set.find("42") == &*set.find("42") );
+
+    // Nothing expires, however long it's left.
+    set.remove_expired();
+    CHECK( set.size() == 1000 );
+
+    CHECK( set.erase("500") );
+    CHECK_FALSE( set.member("500") );
+    CHECK( set.size() == 999 );
+
+    size_t count = 0;
+    for (const string& each : set) count += !each.empty();
+    CHECK( count == 999 );
+
+    set.for_each_live([&](const string&) { --count; });
+    CHECK( count == 0 );
+
+    CHECK( set.find_or_insert(string("7"), [] { return string("x"); })
+           == "7" );
+    CHECK( set.find_or_insert(string("new"), [] { return string("new"); })
+           == "new" );
+    CHECK( set.member("new") );
+
+    rh_unordered_set<string> copy(set);
+    CHECK( copy.size() == set.size() );
+    CHECK( copy.member("999") );
+}
+
+TEST_CASE("strong Robin Hood map")
+{
+    rh_unordered_map<string, vector<int>> map;
+
+    for (int i = 0; i < 1000; ++i)
+        map.insert({to_string(i), vector<int>{i}});
+
+    CHECK( map.size() == 1000 );
+    CHECK( (*map.find("42")).second == vector<int>{42} );
+
+    // Values may be modified in place.
+    (*map.find("42")).second.push_back(43);
+    CHECK( (*map.find("42")).second == (vector<int>{42, 43}) );
+
+    map["42"].push_back(44);
+    CHECK( map["42"].size() == 3 );
+
+    CHECK( map["none"].empty() );
+    CHECK( map.size() == 1001 );
+
+    // Inserting an existing key replaces its value.
+    map.insert({"1", vector<int>{}});
+    CHECK( map["1"].empty() );
+
+    const auto& const_map = map;
+    CHECK( (*const_map.find("2")).second == vector<int>{2} );
+
+    int sum = 0;
+    map.for_each_live([&](auto& view) {
+        if (!view.second.empty()) sum += view.second.front();
+    });
+    CHECK( sum == 999 * 1000 / 2 - 1 );
+}
+
+namespace {
+
+// Counts the keys it hashes, which is one per probe.
+struct counting_hash
+{
+    size_t* count;
+
+    size_t operator()(int key) const
+    {
+        ++*count;
+        return std::hash<int>()(key);
+    }
+};
+
+}
+
+TEST_CASE("map subscripts probe once")
+{
+    size_t hashes = 0;
+    rh_unordered_map<int, int, counting_hash> map(
+            default_bucket_count, counting_hash{&hashes});
+
+    // Both a miss, which inserts, and a hit hash the key just once.
+    map[1] = 10;
+    CHECK( hashes == 1 );
+    CHECK( map[1] == 10 );
+    CHECK( hashes == 2 );
+
+    // References stay good while the table grows and rehashes around
+    // each new entry.
+    map.set_rehash_step(2);
+    for (int i = 0; i < 1000; ++i) map[i] += i;
+
+    CHECK( map.size() == 1000 );
+    for (int i = 0; i < 1000; ++i)
+        CHECK( map[i] == (i == 1 ? 11 : i) );
+}
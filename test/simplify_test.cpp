@@ -0,0 +1,84 @@
+#include "simplify.h"
+#include "util/stringify.h"
+#include <catch.hpp>
+
+using namespace std;
+using namespace intersections;
+
+namespace {
+
+type Int()
+{
+    return type::make<int_ty>();
+}
+
+type Real()
+{
+    return type::make<real_ty>();
+}
+
+type Top()
+{
+    return type::make<top_ty>();
+}
+
+type fun(vector<type> arguments, type result)
+{
+    return type::make<function_ty>(std::move(arguments), std::move(result));
+}
+
+type meet(vector<type> members)
+{
+    return type::make<intersection_ty>(std::move(members));
+}
+
+} // end anonymous namespace
+
+TEST_CASE("interning")
+{
+    CHECK( Int() == Int() );
+    CHECK( Int() != Real() );
+    CHECK( fun({Int()}, Real()) == fun({Int()}, Real()) );
+    CHECK( fun({Int()}, Real()) != fun({Real()}, Int()) );
+    CHECK( stringify(meet({fun({Int()}, Real()), Int()}))
+           == "((Int) -> Real) & Int" );
+}
+
+TEST_CASE("simplifier rules")
+{
+    simplifier simplify;
+
+    CHECK( simplify(Int()) == Int() );
+    CHECK( simplify(meet({Int(), Int()})) == Int() );
+    CHECK( simplify(meet({Int(), meet({Real(), Int()})}))
+           == meet({Int(), Real()}) );
+    CHECK( simplify(meet({Top(), Int(), Top()})) == Int() );
+    CHECK( simplify(meet({})) == Top() );
+    CHECK( simplify(fun({Int()}, Top())) == Top() );
+    CHECK( simplify(fun({Int()}, meet({Top(), Top()}))) == Top() );
+    CHECK( simplify(meet({fun({Int()}, Int()), fun({Int()}, Real())}))
+           == fun({Int()}, meet({Int(), Real()})) );
+    CHECK( simplify(meet({fun({Int()}, Int()), fun({Int()}, Int())}))
+           == fun({Int()}, Int()) );
+}
+
+TEST_CASE("simplifier memoizes normal forms")
+{
+    simplifier simplify;
+
+    auto ty = meet({Int(), meet({Int(), Int()})});
+    auto normal = simplify(ty);
+    CHECK( normal == Int() );
+
+    size_t steps = simplify.steps();
+    CHECK( simplify(ty) == normal );
+    CHECK( simplify.steps() == steps );
+}
+
+TEST_CASE("simplifier stops when out of steps")
+{
+    simplifier simplify(simplifier::default_rules(), 1);
+
+    auto ty = meet({meet({Int(), Int()})});
+    CHECK( simplify(ty) != Int() );
+}
@@ -1,6 +1,7 @@
 #include "intersections.h"
 #include "util/stringify.h"
 #include <catch.hpp>
+#include <thread>
 
 using namespace std;
 using namespace intersections;
@@ -17,3 +18,45 @@ TEST_CASE("object-based types")
           == "(Int, Real) -> Double");
 }
 
+
+TEST_CASE("types are shared across threads and remade after dying")
+{
+    auto make_sig = [] {
+        return type::make<function_ty>(vector{type::make<int_ty>(),
+                                              type::make<top_ty>()},
+                                       type::make<real_ty>());
+    };
+
+    auto sig = make_sig();
+    CHECK( make_sig() == sig );
+
+    type elsewhere = type::make<int_ty>();
+    thread([&] { elsewhere = make_sig(); }).join();
+    CHECK( elsewhere == sig );
+
+    // Once every copy is gone, the node dies, and making the type again
+    // makes a new node rather than finding the dead one.
+    weak_ptr<const type_impl_base> old = sig.impl();
+    sig = elsewhere = type::make<int_ty>();
+    CHECK( old.expired() );
+
+    auto again = make_sig();
+    CHECK( stringify(again) == "(Int, Top) -> Real" );
+    CHECK( make_sig() == again );
+}
+
+TEST_CASE("making an existing type of any kind finds its node")
+{
+    auto real = type::make<real_ty>();
+    CHECK( type::make<real_ty>().impl() == real.impl() );
+    CHECK( type::make<real_ty>() != type::make<int_ty>() );
+
+    auto both = type::make<intersection_ty>(vector{type::make<int_ty>(),
+                                                   real});
+    CHECK( type::make<intersection_ty>(vector{type::make<int_ty>(), real})
+           .impl() == both.impl() );
+    CHECK( stringify(both) == "Int & Real" );
+
+    CHECK( type::make<intersection_ty>(vector<type>{}).impl()
+           == type::make<intersection_ty>(vector<type>{}).impl() );
+}
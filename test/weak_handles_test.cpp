@@ -0,0 +1,117 @@
+#include "util/weak_handles.h"
+#include <catch.hpp>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace intersections::util;
+
+TEST_CASE("intrusive pointers")
+{
+    static_assert(sizeof(intrusive_weak_ptr<const string>) == sizeof(void*));
+
+    auto one = make_intrusive<const string>("one");
+    intrusive_weak_ptr<const string> weak = one;
+    CHECK_FALSE( weak.expired() );
+    CHECK( weak.lock() == one );
+
+    auto copy = one;
+    one = nullptr;
+    CHECK( *weak.lock() == "one" );
+
+    copy = nullptr;
+    CHECK( weak.expired() );
+    CHECK_FALSE( weak.lock() );
+    CHECK_FALSE( intrusive_weak_ptr<const string>().lock() );
+}
+
+TEST_CASE("intrusive weak set")
+{
+    intrusive_weak_unordered_set<string> set;
+
+    vector<intrusive_ptr<const string>> holder;
+    for (int i = 0; i < 100; ++i) {
+        holder.push_back(make_intrusive<const string>(to_string(i)));
+        set.insert(holder.back());
+    }
+
+    CHECK( set.member("42") );
+    CHECK( *set.find("42") == holder[42] );
+    CHECK_FALSE( set.member("100") );
+
+    auto again = set.find_or_insert(string("7"), [] {
+        return make_intrusive<const string>("new");
+    });
+    CHECK( again == holder[7] );
+
+    holder.resize(50);
+    CHECK_FALSE( set.member("75") );
+    set.remove_expired();
+    CHECK( set.size() == 50 );
+}
+
+namespace {
+struct test_arena_tag;
+}
+
+TEST_CASE("arena handles")
+{
+    using arena_t = slot_arena<string, test_arena_tag>;
+    static_assert(sizeof(arena_t::handle) == 8);
+
+    auto& arena = arena_t::instance();
+    auto one = arena.make("one");
+    arena_t::handle handle = one;
+    CHECK( *handle.lock() == "one" );
+    CHECK( arena.size() == 1 );
+
+    CHECK( arena.destroy(handle) );
+    CHECK_FALSE( arena.destroy(handle) );
+    CHECK( handle.expired() );
+    CHECK_FALSE( handle.lock() );
+    CHECK( arena.size() == 0 );
+
+    // The slot is reused, under a new generation.
+    auto two = arena.make("two");
+    CHECK( two.index() == one.index() );
+    CHECK( two.generation() != one.generation() );
+    CHECK( two != one );
+    CHECK( handle.expired() );
+    CHECK_FALSE( arena_t::handle().lock() );
+
+    arena.destroy(two);
+}
+
+TEST_CASE("arena weak set")
+{
+    using arena_t = slot_arena<string, test_arena_tag>;
+    auto& arena = arena_t::instance();
+    arena_weak_unordered_set<string, test_arena_tag> set;
+
+    vector<arena_t::ref> refs;
+    for (int i = 0; i < 100; ++i) {
+        refs.push_back(arena.make(to_string(i)));
+        set.insert(refs.back());
+    }
+
+    CHECK( set.member("42") );
+    CHECK( (*set.find("42")).get() == refs[42].get() );
+
+    for (int i = 0; i < 100; i += 2) arena.destroy(refs[i]);
+    CHECK_FALSE( set.member("42") );
+    CHECK( set.member("43") );
+
+    // Making "42" again reuses a slot, but the set sees it as new.
+    auto again = set.find_or_insert(string("42"), [&] {
+        return arena.make("42");
+    });
+    CHECK( *again == "42" );
+    CHECK( set.member("42") );
+
+    set.remove_expired();
+    CHECK( set.size() == 51 );
+
+    for (int i = 1; i < 100; i += 2) arena.destroy(refs[i]);
+    arena.destroy(again);
+    CHECK( arena.size() == 0 );
+}
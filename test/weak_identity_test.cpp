@@ -0,0 +1,102 @@
+#include "util/memoize.h"
+#include "util/weak_identity.h"
+#include <catch.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace intersections::util;
+
+TEST_CASE("address hashing")
+{
+    vector<int> objects(1000);
+    address_hash<int> hash;
+    address_equal<int> equal;
+
+    // Neighboring addresses spread over the low bits.
+    size_t low_bits = 0;
+    for (const int& each : objects) low_bits |= size_t(1) << (hash(each) & 63);
+    CHECK( low_bits == ~size_t(0) );
+
+    CHECK( equal(objects[3], objects[3]) );
+    CHECK_FALSE( equal(objects[3], objects[4]) );
+}
+
+TEST_CASE("weak identity set")
+{
+    weak_identity_set<string> set;
+
+    vector<shared_ptr<const string>> holder;
+    for (int i = 0; i < 100; ++i) {
+        holder.push_back(make_shared<const string>(to_string(i)));
+        set.insert(holder.back());
+    }
+
+    CHECK( set.size() == 100 );
+    CHECK( set.member(*holder[42]) );
+    CHECK( *set.find(*holder[42]) == holder[42] );
+
+    // Equal isn't enough: it has to be the same object.
+    CHECK_FALSE( set.member(string("42")) );
+    auto twin = make_shared<const string>("42");
+    set.insert(twin);
+    CHECK( set.size() == 101 );
+    CHECK( *set.find(*twin) == twin );
+
+    CHECK( set.find_or_insert(*holder[7], [] {
+        return make_shared<const string>("unused");
+    }) == holder[7] );
+
+    CHECK( set.erase(*holder[3]) );
+    CHECK_FALSE( set.member(*holder[3]) );
+
+    holder.resize(50);
+    set.remove_expired();
+    CHECK( set.size() == 49 + 1 );
+}
+
+TEST_CASE("weak identity map")
+{
+    weak_identity_map<string, int> map;
+
+    auto one = make_shared<const string>("one");
+    auto other_one = make_shared<const string>("one");
+
+    CHECK( map.try_emplace(one, 1).second == 1 );
+    CHECK( map.try_emplace(one, 2).second == 1 );
+    CHECK( map.try_emplace(other_one, 3).second == 3 );
+    CHECK( map.size() == 2 );
+
+    (*map.find(*one)).second += 10;
+    CHECK( (*map.find(*one)).second == 11 );
+
+    // An entry lives as long as its key.
+    other_one = nullptr;
+    map.remove_expired();
+    CHECK( map.size() == 1 );
+
+    int sum = 0;
+    map.for_each_live([&](auto& view) { sum += view.second; });
+    CHECK( sum == 11 );
+}
+
+TEST_CASE("memoizing by address")
+{
+    size_t calls = 0;
+    memoize<size_t(shared_ptr<const string>),
+            address_hash<string>, address_equal<string>> length(
+            [&](const shared_ptr<const string>& s) {
+                ++calls;
+                return s->size();
+            });
+
+    auto hello = make_shared<const string>("hello");
+    CHECK( length(hello) == 5 );
+    CHECK( length(hello) == 5 );
+    CHECK( calls == 1 );
+
+    // An equal string that isn't the same one misses.
+    CHECK( length(make_shared<const string>("hello")) == 5 );
+    CHECK( calls == 2 );
+}
@@ -1,6 +1,9 @@
 #include "util/weak_unordered_set.h"
 #include <catch.hpp>
+#include <iterator>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 using namespace std;
@@ -50,3 +53,992 @@ TEST_CASE("growing")
 
     CHECK( 1000 == set.size() );
 }
+
+namespace {
+
+// Puts everything in a few long clusters.
+struct clustering_hash
+{
+    size_t operator()(int i) const
+    {
+        return size_t(i % 3);
+    }
+};
+
+} // end anonymous namespace
+
+TEST_CASE("erasing from the middle of a cluster")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int, clustering_hash> set;
+
+    for (int i = 0; i < 30; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+
+    for (int i = 0; i < 30; i += 2) {
+        CHECK( set.erase(i) );
+        CHECK_FALSE( set.erase(i) );
+    }
+
+    CHECK( set.size() == 15 );
+    for (int i = 0; i < 30; ++i) {
+        CHECK( set.member(i) == (i % 2 == 1) );
+    }
+}
+
+TEST_CASE("remove_expired compacts clusters")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int, clustering_hash> set;
+
+    for (int i = 0; i < 30; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+
+    for (int i = 0; i < 30; i += 3) holder[i] = nullptr;
+
+    set.remove_expired();
+    CHECK( set.size() == 20 );
+    for (int i = 0; i < 30; ++i) {
+        CHECK( set.member(i) == (i % 3 != 0) );
+    }
+}
+
+TEST_CASE("insert and erase churn")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int> set;
+
+    for (int i = 0; i < 64; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+
+    size_t buckets = set.bucket_count();
+
+    for (int round = 0; round < 1000; ++round) {
+        int old_key = round;
+        int new_key = round + 64;
+        CHECK( set.erase(old_key) );
+        holder[size_t(old_key % 64)] = make_shared<int>(new_key);
+        set.insert(holder[size_t(old_key % 64)]);
+    }
+
+    CHECK( set.size() == 64 );
+    CHECK( set.bucket_count() == buckets );
+    for (int i = 1000; i < 1064; ++i) {
+        CHECK( set.member(i) );
+    }
+    CHECK_FALSE( set.member(999) );
+}
+
+TEST_CASE("weak value map lookups")
+{
+    weak_value_unordered_map<int, string> map;
+
+    auto one = make_shared<string>("one");
+    auto two = make_shared<string>("two");
+    map.insert({1, one});
+    map.insert({2, two});
+
+    CHECK( map.member(1) );
+    CHECK( *(*map.find(2)).second == "two" );
+
+    two = nullptr;
+    CHECK_FALSE( map.member(2) );
+
+    // Reinserting over the expired entry reuses it.
+    two = make_shared<string>("deux");
+    map.insert({2, two});
+    CHECK( *(*map.find(2)).second == "deux" );
+    CHECK( map.size() == 2 );
+}
+
+TEST_CASE("weak key map lookups")
+{
+    weak_key_unordered_map<string, int> map;
+
+    auto one = make_shared<const string>("one");
+    map.insert({one, 1});
+    CHECK( (*map.find("one")).second == 1 );
+
+    one = nullptr;
+    CHECK_FALSE( map.member("one") );
+}
+
+namespace {
+
+template <class SizePolicy>
+void check_size_policy()
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int, hash<int>, equal_to<int>, allocator<int>,
+                       SizePolicy> set;
+
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+
+    CHECK( set.bucket_count() == SizePolicy::round_up(set.bucket_count()) );
+    for (int i = 0; i < 1000; ++i) {
+        CHECK( set.member(i) );
+    }
+    CHECK_FALSE( set.member(1000) );
+
+    for (int i = 0; i < 1000; i += 2) {
+        CHECK( set.erase(i) );
+    }
+    for (int i = 0; i < 1000; ++i) {
+        CHECK( set.member(i) == (i % 2 == 1) );
+    }
+}
+
+} // end anonymous namespace
+
+TEST_CASE("sizing policies")
+{
+    SECTION("power of two") {
+        check_size_policy<power_of_two_sizing>();
+    }
+
+    SECTION("fastrange") {
+        check_size_policy<fastrange_sizing>();
+    }
+
+    SECTION("prime") {
+        check_size_policy<prime_sizing>();
+        CHECK( prime_sizing::round_up(12) == 17 );
+    }
+}
+
+namespace {
+
+// Gives every key the same hash code, so they form one cluster that
+// wraps around the end of the table unless it starts at the front.
+struct constant_hash
+{
+    size_t code;
+
+    size_t operator()(int) const
+    {
+        return code;
+    }
+};
+
+// Fills tables with fewer buckets than a probe_group as full as they get
+// without growing, with the cluster starting in each bucket in turn, so
+// that a single group load sees some buckets twice.
+template <class SizePolicy>
+void check_small_table(size_t bucket_count)
+{
+    using set_t = weak_unordered_set<int, constant_hash, equal_to<int>,
+                                     allocator<int>, SizePolicy>;
+
+    int count = int(double(bucket_count) * grow_at_ratio);
+
+    for (size_t i = 0; i < 4 * bucket_count; ++i) {
+        set_t set(bucket_count,
+                  constant_hash{i * size_t(0x9E3779B97F4A7C15)});
+        set.set_shrink_at_ratio(0);
+        REQUIRE( set.bucket_count() == bucket_count );
+
+        vector<shared_ptr<int>> holder;
+        for (int key = 0; key < count; ++key) {
+            holder.push_back(make_shared<int>(key));
+            set.insert(holder.back());
+        }
+
+        CHECK( set.bucket_count() == bucket_count );
+        for (int key = 0; key < count; ++key) {
+            CHECK( set.member(key) );
+        }
+        CHECK_FALSE( set.member(count) );
+
+        // Erasing the first shifts the rest back around the end.
+        CHECK( set.erase(0) );
+        CHECK_FALSE( set.member(0) );
+        for (int key = 1; key < count; ++key) {
+            CHECK( set.member(key) );
+        }
+
+        size_t live = 0;
+        for (const auto& each : set) ++live;
+        CHECK( live == size_t(count - 1) );
+    }
+}
+
+template <class SizePolicy>
+void check_small_tables()
+{
+    size_t tried = 0;
+
+    for (size_t n = 2; n < probe_group::width; ++n) {
+        if (SizePolicy::round_up(n) != n) continue;
+        check_small_table<SizePolicy>(n);
+        ++tried;
+    }
+
+    CHECK( tried > 0 );
+}
+
+} // end anonymous namespace
+
+TEST_CASE("tables smaller than a probe group")
+{
+    SECTION("power of two") {
+        check_small_tables<power_of_two_sizing>();
+    }
+
+    SECTION("fastrange") {
+        check_small_tables<fastrange_sizing>();
+    }
+
+    SECTION("prime") {
+        check_small_tables<prime_sizing>();
+    }
+}
+
+TEST_CASE("incremental rehashing")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int> set;
+    set.set_rehash_step(2);
+    CHECK( set.rehash_step() == 2 );
+
+    bool saw_rehashing = false;
+
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+
+        if (set.rehashing()) {
+            saw_rehashing = true;
+
+            // Everything is still there, in one array or the other.
+            bool all_there = true;
+            for (int j = 0; j <= i; ++j) {
+                all_there = all_there && set.member(j);
+            }
+            CHECK( all_there );
+
+            size_t count = 0;
+            for (const auto& ptr : set) {
+                if (ptr) ++count;
+            }
+            CHECK( count == size_t(i + 1) );
+        }
+    }
+
+    CHECK( saw_rehashing );
+
+    // Reinserting an element that hasn't moved yet doesn't duplicate it.
+    while (!set.rehashing()) {
+        holder.push_back(make_shared<int>(int(holder.size())));
+        set.insert(holder.back());
+    }
+    auto n = set.size();
+    set.insert(holder[1]);
+    CHECK( set.size() == n );
+    CHECK( *set.find(1) == holder[1] );
+
+    // Erasing and expiring while rehashing.
+    CHECK( set.erase(3) );
+    CHECK_FALSE( set.erase(3) );
+    holder[5] = nullptr;
+    CHECK_FALSE( set.member(3) );
+    CHECK_FALSE( set.member(5) );
+
+    set.remove_expired();
+    CHECK_FALSE( set.rehashing() );
+    CHECK( set.size() == holder.size() - 2 );
+    for (size_t i = 0; i < holder.size(); ++i) {
+        CHECK( set.member(int(i)) == (i != 3 && i != 5) );
+    }
+}
+
+TEST_CASE("incremental sweeping")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int> set(256);
+    set.set_sweep_step(8);
+
+    for (int i = 0; i < 100; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+    CHECK( set.size() == 100 );
+
+    // Let half of them expire; the sweep finds them as we insert.
+    for (int i = 0; i < 100; i += 2) {
+        holder[i] = nullptr;
+    }
+    for (int i = 100; i < 140; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+
+    CHECK( set.bucket_count() == 256 );
+    CHECK( set.size() == 90 );
+    for (int i = 0; i < 140; ++i) {
+        CHECK( set.member(i) == (i >= 100 || i % 2 == 1) );
+    }
+}
+
+TEST_CASE("expired elements don't make the table grow")
+{
+    weak_unordered_set<int> set;
+    size_t buckets = set.bucket_count();
+
+    // Each element expires right after insertion.
+    for (int i = 0; i < 1000; ++i) {
+        set.insert(make_shared<int>(i));
+    }
+
+    CHECK( set.bucket_count() == buckets );
+    CHECK( set.size() <= buckets );
+}
+
+TEST_CASE("reserve, rehash and shrink_to_fit")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int> set;
+
+    set.reserve(1000);
+    size_t buckets = set.bucket_count();
+    CHECK( buckets >= 1000 );
+
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+    CHECK( set.bucket_count() == buckets );
+
+    holder.resize(10);
+    set.shrink_to_fit();
+    CHECK( set.size() == 10 );
+    CHECK( set.bucket_count() == 16 );
+    for (int i = 0; i < 20; ++i) {
+        CHECK( set.member(i) == (i < 10) );
+    }
+
+    set.rehash(100);
+    CHECK( set.bucket_count() == 128 );
+    CHECK( set.member(9) );
+
+    holder.clear();
+    set.shrink_to_fit();
+    CHECK( set.bucket_count() == 0 );
+    CHECK_FALSE( set.member(0) );
+
+    holder.push_back(make_shared<int>(0));
+    set.insert(holder.back());
+    CHECK( set.member(0) );
+
+    // Copies keep the reservation and the other settings.
+    set.reserve(1000);
+    set.set_rehash_step(4);
+    set.set_sweep_step(8);
+    set.set_shrink_at_ratio(0.1);
+    set.set_retention_window(16);
+
+    auto check_settings = [&](const weak_unordered_set<int>& copy) {
+        CHECK( copy.bucket_count() == set.bucket_count() );
+        CHECK( copy.rehash_step() == 4 );
+        CHECK( copy.sweep_step() == 8 );
+        CHECK( copy.shrink_at_ratio() == 0.1 );
+        CHECK( copy.retention_window() == 16 );
+        CHECK( copy.member(0) );
+    };
+
+    check_settings(weak_unordered_set<int>(set));
+    check_settings(weak_unordered_set<int>(set, allocator<int>()));
+}
+
+TEST_CASE("shrinking automatically")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int> set;
+    set.set_shrink_at_ratio(0.5);
+    CHECK( set.shrink_at_ratio() == 0.75 / 4 );
+
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+    size_t buckets = set.bucket_count();
+
+    for (int i = 0; i < 990; ++i) {
+        CHECK( set.erase(i) );
+    }
+    CHECK( set.bucket_count() < buckets / 8 );
+    for (int i = 0; i < 1000; ++i) {
+        CHECK( set.member(i) == (i >= 990) );
+    }
+
+    // Expiry followed by a sweep shrinks, too.
+    holder.resize(990);
+    for (int i = 0; i < 500; ++i) {
+        holder.push_back(make_shared<int>(1000 + i));
+        set.insert(holder.back());
+    }
+    buckets = set.bucket_count();
+    holder.resize(990);
+    set.remove_expired();
+    CHECK( set.size() == 0 );
+    CHECK( set.bucket_count() < buckets );
+}
+
+TEST_CASE("shrinking waits for an incremental rehash")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int> set;
+    set.set_rehash_step(2);
+    set.set_shrink_at_ratio(1);
+
+    while (!set.rehashing() || set.bucket_count() < 1024) {
+        holder.push_back(make_shared<int>(int(holder.size())));
+        set.insert(holder.back());
+    }
+    size_t buckets = set.bucket_count();
+
+    // Erasing brings the load below the shrinking point well before the
+    // rehash is done, but the table keeps its buckets until then, and
+    // shrinks right after.
+    int erased = 0;
+    int erased_when_below = 0;
+    while (set.bucket_count() == buckets) {
+        REQUIRE( set.erase(erased++) );
+        if (erased_when_below == 0 && double(set.size())
+                / double(buckets) < set.shrink_at_ratio())
+            erased_when_below = erased;
+    }
+
+    CHECK( erased_when_below > 0 );
+    CHECK( erased > erased_when_below );
+    CHECK( set.bucket_count() < buckets );
+    for (int i = 0; i < int(holder.size()); ++i) {
+        CHECK( set.member(i) == (i >= erased) );
+    }
+}
+
+TEST_CASE("eager eviction")
+{
+    weak_unordered_set<string> set;
+
+    auto hello = set.make_evicting("hello");
+    auto world = set.make_evicting("world");
+    set.insert(hello);
+    set.insert(world);
+    CHECK( set.size() == 2 );
+
+    hello = nullptr;
+    CHECK( set.size() == 1 );
+    CHECK_FALSE( set.member("hello") );
+    CHECK( set.member("world") );
+
+    // Evicting keys follow their table when it's moved.
+    weak_unordered_set<string> other;
+    swap(set, other);
+    world = nullptr;
+    CHECK( other.size() == 0 );
+    CHECK( set.size() == 0 );
+
+    // Keys may outlive their table.
+    shared_ptr<const string> survivor;
+    {
+        weak_unordered_set<string> temporary;
+        survivor = temporary.make_evicting("survivor");
+        temporary.insert(survivor);
+    }
+    survivor = nullptr;
+}
+
+TEST_CASE("eager eviction keeps clusters intact")
+{
+    vector<shared_ptr<const int>> holder;
+    weak_unordered_set<int, clustering_hash> set;
+
+    for (int i = 0; i < 30; ++i) {
+        holder.push_back(set.make_evicting(i));
+        set.insert(holder.back());
+    }
+
+    for (int i = 0; i < 30; i += 2) {
+        holder[i] = nullptr;
+    }
+
+    CHECK( set.size() == 15 );
+    for (int i = 0; i < 30; ++i) {
+        CHECK( set.member(i) == (i % 2 == 1) );
+    }
+}
+
+namespace {
+
+struct transparent_string_hash
+{
+    using is_transparent = void;
+
+    size_t operator()(string_view s) const
+    {
+        return hash<string_view>()(s);
+    }
+};
+
+} // end anonymous namespace
+
+TEST_CASE("transparent lookup and precomputed hash codes")
+{
+    weak_unordered_set<string, transparent_string_hash, equal_to<>> set;
+
+    auto hello = make_shared<string>("hello");
+    set.insert(hello);
+
+    CHECK( set.member(string_view("hello")) );
+    CHECK( set.member("hello") );
+    CHECK_FALSE( set.member(string_view("world")) );
+    CHECK( set.count(string_view("hello")) == 1 );
+    CHECK( *set.find(string_view("hello")) == hello );
+
+    size_t hash_code = transparent_string_hash()("hello");
+    CHECK( set.member(string("hello"), hash_code) );
+    CHECK( *set.find(string_view("hello"), hash_code) == hello );
+    CHECK( set.find(string_view("world"), hash_code) == set.end() );
+}
+
+TEST_CASE("find_or_insert")
+{
+    weak_unordered_set<string> set;
+    size_t made = 0;
+
+    auto make = [&](const char* s) {
+        return set.find_or_insert(string(s), [&] {
+            ++made;
+            return make_shared<const string>(s);
+        });
+    };
+
+    auto hello = make("hello");
+    CHECK( *hello == "hello" );
+    CHECK( made == 1 );
+
+    CHECK( make("hello") == hello );
+    CHECK( made == 1 );
+
+    auto world = make("world");
+    CHECK( made == 2 );
+    CHECK( set.size() == 2 );
+
+    // An expired element gets replaced.
+    world = nullptr;
+    world = make("world");
+    CHECK( made == 3 );
+    CHECK( set.member("world") );
+}
+
+TEST_CASE("try_emplace")
+{
+    SECTION("set") {
+        weak_unordered_set<string> set;
+        auto a = set.try_emplace(3, 'a');
+        CHECK( *a == "aaa" );
+        CHECK( set.try_emplace("aaa") == a );
+        CHECK( set.size() == 1 );
+    }
+
+    SECTION("weak key map") {
+        weak_key_unordered_map<string, int> map;
+        auto one = make_shared<const string>("one");
+        CHECK( map.try_emplace(one, 1).second == 1 );
+        CHECK( map.try_emplace(one, 2).second == 1 );
+        CHECK( map.size() == 1 );
+    }
+
+    SECTION("weak value map") {
+        weak_value_unordered_map<int, string> map;
+        auto one = map.try_emplace(1, "one").second;
+        CHECK( *one == "one" );
+        CHECK( map.try_emplace(1, "uno").second == one );
+
+        // Nothing holds on to the value, so it expires and is replaced.
+        one = nullptr;
+        CHECK( *map.try_emplace(1, "uno").second == "uno" );
+    }
+
+    SECTION("weak map") {
+        weak_unordered_map<string, int> map;
+        auto one = make_shared<const string>("one");
+        auto value = map.try_emplace(one, 1).second;
+        CHECK( map.try_emplace(one, 2).second == value );
+        CHECK( *value == 1 );
+    }
+}
+
+TEST_CASE("batch insert and find_many")
+{
+    vector<shared_ptr<const int>> holder;
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(make_shared<const int>(i));
+    }
+
+    weak_unordered_set<int> set;
+    set.insert(holder.begin(), holder.end());
+    CHECK( set.size() == 1000 );
+    CHECK( set.bucket_count() == 2048 );
+
+    vector<int> keys{0, 999, 1000, 500, -1};
+    vector<weak_unordered_set<int>::const_iterator> found;
+    set.find_many(keys.begin(), keys.end(), back_inserter(found));
+
+    REQUIRE( found.size() == 5 );
+    CHECK( *found[0] == holder[0] );
+    CHECK( *found[1] == holder[999] );
+    CHECK( found[2] == set.end() );
+    CHECK( *found[3] == holder[500] );
+    CHECK( found[4] == set.end() );
+}
+
+TEST_CASE("reserve keeps automatic shrinking at bay")
+{
+    vector<shared_ptr<int>> holder;
+    weak_unordered_set<int> set;
+    set.set_shrink_at_ratio(0.1);
+    set.reserve(1000);
+    size_t buckets = set.bucket_count();
+
+    for (int i = 0; i < 10; ++i) {
+        holder.push_back(make_shared<int>(i));
+        set.insert(holder.back());
+    }
+    CHECK( set.bucket_count() == buckets );
+
+    set.shrink_to_fit();
+    CHECK( set.bucket_count() < buckets );
+}
+
+namespace {
+
+// Scatters keys over the table, so that clusters form.
+struct scrambling_hash
+{
+    size_t operator()(int key) const
+    {
+        size_t h = size_t(key) * 0x9E3779B97F4A7C15ull;
+        return h ^ (h >> 29);
+    }
+};
+
+template <class SizePolicy>
+void check_parallel_upkeep()
+{
+    using set_t = weak_unordered_set<int, scrambling_hash, equal_to<int>,
+                                     allocator<int>, SizePolicy>;
+    work_stealing_pool pool(4);
+
+    vector<shared_ptr<const int>> holder;
+    set_t set;
+    for (int i = 0; i < 200000; ++i) {
+        holder.push_back(make_shared<const int>(i));
+        set.insert(holder.back());
+    }
+
+    // Every third element expires.
+    for (size_t i = 0; i < holder.size(); i += 3) holder[i] = nullptr;
+
+    set.remove_expired(pool);
+    CHECK( set.size() == 133333 );
+
+    size_t missing = 0;
+    for (int i = 0; i < 200000; ++i)
+        missing += set.member(i) != (i % 3 != 0);
+    CHECK( missing == 0 );
+    CHECK( size_t(distance(set.begin(), set.end())) == set.size() );
+
+    size_t buckets = set.bucket_count();
+    for (size_t i = 1; i < holder.size(); i += 3) holder[i] = nullptr;
+
+    set.rehash(4 * buckets, pool);
+    CHECK( set.bucket_count() >= 4 * buckets );
+    CHECK( set.size() == 66666 );
+
+    for (int i = 0; i < 200000; ++i)
+        missing += set.member(i) != (i % 3 == 2);
+    CHECK( missing == 0 );
+    CHECK( size_t(distance(set.begin(), set.end())) == set.size() );
+
+    // And back down, so that many elements spill between ranges.
+    set.rehash(0, pool);
+    CHECK( set.bucket_count() < buckets );
+    for (int i = 0; i < 200000; ++i)
+        missing += set.member(i) != (i % 3 == 2);
+    CHECK( missing == 0 );
+}
+
+} // end anonymous namespace
+
+TEST_CASE("parallel remove_expired and rehash")
+{
+    SECTION("power of two") {
+        check_parallel_upkeep<power_of_two_sizing>();
+    }
+
+    SECTION("prime") {
+        check_parallel_upkeep<prime_sizing>();
+    }
+}
+
+TEST_CASE("for_each_live")
+{
+    vector<shared_ptr<const int>> holder;
+    weak_unordered_set<int> set;
+    set.reserve(10000);
+
+    // Sparse, with expired elements among the live ones.
+    for (int i = 0; i < 100; ++i) {
+        holder.push_back(make_shared<const int>(i));
+        set.insert(holder.back());
+    }
+    for (size_t i = 0; i < holder.size(); i += 2) holder[i] = nullptr;
+
+    int sum = 0, count = 0;
+    set.for_each_live([&](const shared_ptr<const int>& ptr) {
+        sum += *ptr;
+        ++count;
+    });
+    CHECK( count == 50 );
+    CHECK( sum == 50 * 50 );
+
+    const auto& const_set = set;
+    count = 0;
+    const_set.for_each_live([&](const auto&) { ++count; });
+    CHECK( count == 50 );
+
+    // While rehashing, it visits both the new and the old buckets.
+    weak_unordered_set<int> growing;
+    growing.set_rehash_step(2);
+    vector<shared_ptr<const int>> more;
+    do {
+        more.push_back(make_shared<const int>(int(more.size())));
+        growing.insert(more.back());
+    } while (more.size() < 100 || !growing.rehashing());
+
+    count = 0;
+    growing.for_each_live([&](const auto&) { ++count; });
+    CHECK( size_t(count) == more.size() );
+
+    SECTION("map values can be modified") {
+        weak_key_unordered_map<string, int> map;
+        auto one = make_shared<const string>("one");
+        auto two = make_shared<const string>("two");
+        map.insert({one, 1});
+        map.insert({two, 2});
+        two = nullptr;
+
+        map.for_each_live([](auto& view) { view.second *= 10; });
+        CHECK( (*map.find("one")).second == 10 );
+    }
+}
+
+TEST_CASE("retention window")
+{
+    weak_unordered_set<string> set;
+    set.set_retention_window(2);
+    CHECK( set.retention_window() == 2 );
+
+    size_t made = 0;
+    auto make = [&](const string& s) {
+        return set.find_or_insert(s, [&] {
+            ++made;
+            return make_shared<const string>(s);
+        });
+    };
+
+    // Dropped right away, but the window holds on to it.
+    weak_ptr<const string> a = make("a");
+    CHECK_FALSE( a.expired() );
+    CHECK( *make("a") == "a" );
+    CHECK( made == 1 );
+
+    // Repeated hits take one slot, so "a" survives one other element.
+    make("a");
+    make("b");
+    CHECK_FALSE( a.expired() );
+
+    // Finding counts as a hit, and the third element pushes "a" out.
+    CHECK( set.find("b") != set.end() );
+    make("c");
+    CHECK( a.expired() );
+    CHECK_FALSE( set.member("a") );
+
+    // Const lookups aren't hits, so they leave the window alone.
+    weak_ptr<const string> b = make("b");
+    make("c");
+    const auto& const_set = set;
+    CHECK( const_set.find("b") != const_set.end() );
+    make("d");
+    CHECK( b.expired() );
+
+    set.clear();
+    CHECK( set.retention_window() == 2 );
+    CHECK( made == 4 );
+
+    SECTION("weak value map holds just the values") {
+        weak_value_unordered_map<int, string> map;
+        map.set_retention_window(1);
+
+        weak_ptr<string> one = map.try_emplace(1, "one").second;
+        CHECK_FALSE( one.expired() );
+        CHECK( *map.try_emplace(1, "uno").second == "one" );
+
+        map.try_emplace(2, "two");
+        CHECK( one.expired() );
+    }
+
+    SECTION("an empty window holds nothing") {
+        set.set_retention_window(0);
+        weak_ptr<const string> d = make("d");
+        CHECK( d.expired() );
+    }
+}
+
+TEST_CASE("eviction waits for iterators")
+{
+    vector<shared_ptr<const int>> holder;
+    weak_unordered_set<int> set;
+    set.set_shrink_at_ratio(0.25);
+
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(set.make_evicting(i));
+        set.insert(holder.back());
+    }
+    size_t buckets = set.bucket_count();
+
+    // Each view is the last reference to its key once the holder lets
+    // go, so keys die mid-iteration, and the table mustn't shrink or
+    // shift under the iterator.
+    size_t visited = 0;
+    for (auto it = set.begin(); it != set.end(); ++it) {
+        auto p = *it;
+        holder[*p] = nullptr;
+        ++visited;
+    }
+
+    CHECK( visited == 1000 );
+    CHECK( set.size() == 0 );
+    CHECK( set.bucket_count() == buckets );
+
+    // Shrinking waits for the next modification.
+    holder.push_back(set.make_evicting(0));
+    set.insert(holder.back());
+    CHECK( set.bucket_count() < buckets );
+    CHECK( set.size() == 1 );
+}
+
+namespace {
+
+// Four keys to each hash code, so erasing shifts buckets back.
+struct quartering_hash
+{
+    size_t operator()(int i) const
+    {
+        return size_t(i / 4);
+    }
+};
+
+} // end anonymous namespace
+
+TEST_CASE("for_each_live defers eviction")
+{
+    vector<shared_ptr<const int>> holder;
+    weak_unordered_set<int, quartering_hash> set;
+    set.set_shrink_at_ratio(0.25);
+
+    for (int i = 0; i < 1000; ++i) {
+        holder.push_back(set.make_evicting(i));
+        set.insert(holder.back());
+    }
+
+    // Each view is the last reference to its key by the time it's
+    // destroyed, which mustn't shift the buckets still to be visited.
+    size_t visited = 0;
+    set.for_each_live([&](const shared_ptr<const int>& p) {
+        holder[*p] = nullptr;
+        ++visited;
+    });
+
+    CHECK( visited == 1000 );
+    CHECK( set.size() == 0 );
+}
+
+namespace {
+
+// A weak pointer that counts how often it's locked.
+struct counting_weak
+{
+    using key_type = const int;
+    using strong_type = shared_ptr<const int>;
+    using view_type = strong_type;
+    using const_view_type = strong_type;
+
+    static size_t locks;
+
+    weak_ptr<const int> ptr;
+
+    counting_weak(const strong_type& strong) : ptr(strong) { }
+
+    bool expired() const
+    {
+        return ptr.expired();
+    }
+
+    strong_type lock() const
+    {
+        ++locks;
+        return ptr.lock();
+    }
+
+    static const int* key(const strong_type& view)
+    {
+        return view.get();
+    }
+
+    static strong_type move(view_type& view)
+    {
+        return std::move(view);
+    }
+};
+
+size_t counting_weak::locks = 0;
+
+} // end anonymous namespace
+
+TEST_CASE("a hit locks its bucket once")
+{
+    rh_weak_hash_table<counting_weak, hash<int>, equal_to<int>> set;
+
+    vector<shared_ptr<const int>> holder;
+    for (int i = 0; i < 100; ++i) {
+        holder.push_back(make_shared<const int>(i));
+        set.insert(holder.back());
+    }
+
+    auto unused = [] { return make_shared<const int>(-1); };
+
+    counting_weak::locks = 0;
+    CHECK( set.find_or_insert(42, unused) == holder[42] );
+    CHECK( counting_weak::locks == 1 );
+
+    // The retention window reuses the same lock.
+    set.set_retention_window(4);
+    counting_weak::locks = 0;
+    CHECK( set.find_or_insert(43, unused) == holder[43] );
+    CHECK( counting_weak::locks == 1 );
+
+    counting_weak::locks = 0;
+    CHECK( set.find(44) != set.end() );
+    CHECK( counting_weak::locks == 1 );
+}